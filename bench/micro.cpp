@@ -0,0 +1,517 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "sl/array.h"
+#include "sl/compiler.h"
+#include "sl/darray.h"
+#include "sl/heap.h"
+#include "sl/struct.h"
+#include "sl/val.h"
+
+// Microbenchmarks of the runtime's core data structures, built and run
+// by `python3 build.py microbench`. Each benchmark is run for more and
+// more iterations until a run takes at least minTime, and the time and
+// allocations per op of that run are reported.
+
+// Seconds a benchmark's last run must take
+static constexpr double minTime = 0.25;
+static constexpr size_t maxIters = size_t(1) << 32;
+
+// Heaps without a collector keep every object created in them, so
+// benchmarks creating objects empty theirs once it holds this many
+static constexpr size_t maxHeapObjects = size_t(1) << 16;
+
+// Allocations made so far by operator new, which everything in the
+// runtime allocates through
+static size_t nAllocs = 0;
+
+void *operator new(size_t size) {
+	nAllocs++;
+	auto r = malloc(size > 0? size : 1);
+	if (!r) {
+		throw std::bad_alloc();
+	}
+	return r;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+// Results are added into this, so the work producing them can't
+// be optimised away
+static volatile double sink;
+
+// Time taken and allocations made while started, so that benchmarks
+// can leave their setup and cleanup out
+struct Meter {
+	double elapsed;
+	size_t nAllocs;
+	
+	std::chrono::steady_clock::time_point startTime;
+	size_t startNAllocs;
+	
+	void start() {
+		startNAllocs = ::nAllocs;
+		startTime = std::chrono::steady_clock::now();
+	}
+	
+	void stop() {
+		elapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		nAllocs += ::nAllocs - startNAllocs;
+	}
+};
+
+struct MicroBench {
+	std::string name;
+	// Ops done by each iteration
+	size_t nOpsPerIter;
+	// Run nIters iterations, starting the meter once set up and
+	// stopping it before cleaning up
+	std::function<void(Meter*, size_t)> run;
+};
+
+// Free every object in the heap, frozen ones included, leaving it empty
+static void clearHeap(SL::Heap *heap) {
+	for (auto object = heap->objects; object; object = object->next) {
+		object->isFrozen = false;
+	}
+	heap->deinit();
+	heap->init(nullptr);
+}
+
+static void clearHeapIfFull(Meter *meter, SL::Heap *heap) {
+	if (heap->nObjects >= maxHeapObjects) {
+		meter->stop();
+		clearHeap(heap);
+		meter->start();
+	}
+}
+
+// Strings prefix0, prefix1, ..., hashed up front, as
+// the compiler does for the names in scripts
+static std::vector<SL::String*> createKeys(SL::Heap *heap, char const *prefix, size_t n) {
+	using namespace SL;
+	
+	std::vector<String*> r;
+	for (auto i = size_t(0); i < n; i++) {
+		auto name = std::string(prefix) + std::to_string(i);
+		auto key = String::create(heap, name.size(), name.c_str());
+		key->hash();
+		r.push_back(key);
+	}
+	return r;
+}
+
+static std::string formatLoad(double load) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.3f", load);
+	return buf;
+}
+
+// Source of a program defining nFuncs small functions, as in the
+// bundle benchmark run by build.py
+static std::string generateSource(size_t nFuncs) {
+	std::string r;
+	for (auto i = size_t(0); i < nFuncs; i++) {
+		auto name = "f" + std::to_string(i);
+		r += name + " = func(a, b) {\n";
+		r += "\tvar t = {x = a, y = b, name = \"" + name + "\"}\n";
+		r += "\tif t.x < t.y {\n";
+		r += "\t\treturn t.x * " + std::to_string(i % 97) + " + t.y\n";
+		r += "\t}\n";
+		r += "\treturn [t.x, t.y, t.name]\n";
+		r += "}\n";
+	}
+	return r;
+}
+
+static void addStructBenches(std::vector<MicroBench> *benches) {
+	using namespace SL;
+	
+	// Tables of the same number of slots, at loads up to the most
+	// they're filled to before growing
+	static constexpr size_t nSlots = 4096;
+	for (auto load: {0.25, 0.5, 0.875}) {
+		auto nKeys = size_t(double(nSlots) * load);
+		
+		// Run with a table of nKeys keys, and as many more keys not in
+		// it, after first inserting and removing nChurnOps of those
+		auto withStruct = [nKeys](auto body, size_t nChurnOps = 0) {
+			return [nKeys, body, nChurnOps](Meter *meter, size_t nIters) {
+				Heap heap;
+				heap.init(nullptr);
+				
+				// Made big enough for the most keys to get nSlots slots
+				auto s = Struct::create(&heap, nSlots / 8 * 7);
+				auto keys = createKeys(&heap, "key", nKeys);
+				auto otherKeys = createKeys(&heap, "other", nKeys);
+				for (auto i = size_t(0); i < nKeys; i++) {
+					s->set(keys[i], Val::newNumber(double(i)));
+				}
+				for (auto i = size_t(0); i < nChurnOps; i++) {
+					auto key = otherKeys[i % nKeys];
+					s->set(key, Val::newNumber(double(i)));
+					s->remove(key);
+				}
+				
+				meter->start();
+				body(s, keys, otherKeys, nIters);
+				meter->stop();
+				
+				clearHeap(&heap);
+				heap.deinit();
+			};
+		};
+		
+		auto getHits = [](Struct *s, auto &keys, auto &, size_t nIters) {
+			auto sum = 0.0;
+			auto k = size_t(0);
+			for (auto i = size_t(0); i < nIters; i++) {
+				Val val;
+				s->get(keys[k], &val);
+				sum += val.numberVal;
+				if (++k == keys.size()) {
+					k = 0;
+				}
+			}
+			sink = sink + sum;
+		};
+		benches->push_back({"Struct::get hit, load " + formatLoad(load), 1, withStruct(getHits)});
+		// Tables that have seen churn, which leaves tombstones
+		// for lookups to probe past
+		benches->push_back({"Struct::get hit after churn, load " + formatLoad(load), 1, withStruct(getHits, nSlots * 16)});
+		
+		benches->push_back({"Struct::get miss, load " + formatLoad(load), 1, withStruct(
+			[](Struct *s, auto &, auto &otherKeys, size_t nIters) {
+				auto nFound = size_t(0);
+				auto k = size_t(0);
+				for (auto i = size_t(0); i < nIters; i++) {
+					Val val;
+					nFound += s->get(otherKeys[k], &val);
+					if (++k == otherKeys.size()) {
+						k = 0;
+					}
+				}
+				sink = sink + double(nFound);
+			}
+		)});
+		
+		benches->push_back({"Struct::set existing, load " + formatLoad(load), 1, withStruct(
+			[](Struct *s, auto &keys, auto &, size_t nIters) {
+				auto k = size_t(0);
+				for (auto i = size_t(0); i < nIters; i++) {
+					s->set(keys[k], Val::newNumber(double(i)));
+					if (++k == keys.size()) {
+						k = 0;
+					}
+				}
+			}
+		)});
+		
+		// Inserting then removing a key each op, leaving
+		// the load the same
+		benches->push_back({"Struct::set new + remove, load " + formatLoad(load), 1, withStruct(
+			[](Struct *s, auto &, auto &otherKeys, size_t nIters) {
+				auto k = size_t(0);
+				for (auto i = size_t(0); i < nIters; i++) {
+					s->set(otherKeys[k], Val::newNumber(double(i)));
+					s->remove(otherKeys[k]);
+					if (++k == otherKeys.size()) {
+						k = 0;
+					}
+				}
+			}
+		)});
+	}
+}
+
+static void addStringBenches(std::vector<MicroBench> *benches) {
+	using namespace SL;
+	
+	for (auto nChars: {size_t(8), size_t(64), size_t(1024)}) {
+		auto suffix = ", " + std::to_string(nChars) + " chars";
+		
+		benches->push_back({"String::hash" + suffix, 1, [nChars](Meter *meter, size_t nIters) {
+			Heap heap;
+			heap.init(nullptr);
+			auto chars = std::string(nChars, 'a');
+			auto str = String::create(&heap, nChars, chars.c_str());
+			
+			meter->start();
+			auto sum = uint32_t(0);
+			for (auto i = size_t(0); i < nIters; i++) {
+				// Forget the cached hash
+				str->hashVal = 0;
+				sum += str->hash();
+			}
+			meter->stop();
+			sink = sink + double(sum);
+			
+			clearHeap(&heap);
+			heap.deinit();
+		}});
+		
+		// Equal strings that are separate objects, with
+		// their hashes known, as keys always have
+		benches->push_back({"String::isEqual equal" + suffix, 1, [nChars](Meter *meter, size_t nIters) {
+			Heap heap;
+			heap.init(nullptr);
+			auto chars = std::string(nChars, 'a');
+			auto a = String::create(&heap, nChars, chars.c_str());
+			auto b = String::create(&heap, nChars, chars.c_str());
+			a->hash();
+			b->hash();
+			
+			meter->start();
+			auto nEqual = size_t(0);
+			for (auto i = size_t(0); i < nIters; i++) {
+				nEqual += a->isEqual(b);
+			}
+			meter->stop();
+			sink = sink + double(nEqual);
+			
+			clearHeap(&heap);
+			heap.deinit();
+		}});
+	}
+	
+	benches->push_back({"String::isEqual unequal, 64 chars", 1, [](Meter *meter, size_t nIters) {
+		Heap heap;
+		heap.init(nullptr);
+		auto chars = std::string(64, 'a');
+		auto a = String::create(&heap, chars.size(), chars.c_str());
+		chars.back() = 'b';
+		auto b = String::create(&heap, chars.size(), chars.c_str());
+		a->hash();
+		b->hash();
+		
+		meter->start();
+		auto nEqual = size_t(0);
+		for (auto i = size_t(0); i < nIters; i++) {
+			nEqual += a->isEqual(b);
+		}
+		meter->stop();
+		sink = sink + double(nEqual);
+		
+		clearHeap(&heap);
+		heap.deinit();
+	}});
+	
+	// Objects are only formatted by address, so needn't be real ones
+	static char dummyObject;
+	struct {
+		char const *name;
+		Val val;
+	} const vals[] = {
+		{"nil", Val::newNil()},
+		{"integer", Val::newNumber(1234567.0)},
+		{"fraction", Val::newNumber(3.14159)},
+		{"string", Val{.type = typeString}},
+		{"array", Val{.type = typeArray, .ptrVal = &dummyObject}},
+		{"struct", Val{.type = typeStruct, .ptrVal = &dummyObject}},
+		{"func", Val{.type = typeFunc, .ptrVal = &dummyObject}},
+		{"thread", Val{.type = typeThread, .ptrVal = &dummyObject}},
+		{"channel", Val{.type = typeChannel, .ptrVal = &dummyObject}},
+	};
+	for (auto &v: vals) {
+		benches->push_back({std::string("String::createFromVal ") + v.name, 1, [v](Meter *meter, size_t nIters) {
+			Heap heap;
+			heap.init(nullptr);
+			auto val = v.val;
+			if (val.isString()) {
+				val.stringVal = String::create(&heap, 5, "hello");
+			}
+			
+			meter->start();
+			auto nChars = size_t(0);
+			for (auto i = size_t(0); i < nIters; i++) {
+				nChars += String::createFromVal(&heap, val)->nChars;
+				// Keep the string argument's object
+				if (!val.isString()) {
+					clearHeapIfFull(meter, &heap);
+				}
+			}
+			meter->stop();
+			sink = sink + double(nChars);
+			
+			clearHeap(&heap);
+			heap.deinit();
+		}});
+	}
+}
+
+static void addArrayBenches(std::vector<MicroBench> *benches) {
+	using namespace SL;
+	
+	// Pushing onto arrays up to this long, counting the
+	// growth of the buffer
+	static constexpr size_t maxLen = 4096;
+	benches->push_back({"DArray::push, up to " + std::to_string(maxLen) + " elems", 1, [](Meter *meter, size_t nIters) {
+		DArray<Val> array;
+		array.init(8);
+		
+		meter->start();
+		for (auto i = size_t(0); i < nIters; i++) {
+			array.push(Val::newNumber(double(i)));
+			if (array.len == maxLen) {
+				array.deinit();
+				array.init(8);
+			}
+		}
+		meter->stop();
+		sink = sink + array.buf[0].numberVal;
+		
+		array.deinit();
+	}});
+	
+	for (auto nElems: {size_t(0), size_t(4), size_t(64)}) {
+		benches->push_back({"Array::create, " + std::to_string(nElems) + " elems", 1, [nElems](Meter *meter, size_t nIters) {
+			Heap heap;
+			heap.init(nullptr);
+			
+			meter->start();
+			for (auto i = size_t(0); i < nIters; i++) {
+				Array::create(&heap, nElems);
+				clearHeapIfFull(meter, &heap);
+			}
+			meter->stop();
+			
+			clearHeap(&heap);
+			heap.deinit();
+		}});
+	}
+}
+
+static void addCompilerBenches(std::vector<MicroBench> *benches) {
+	using namespace SL;
+	
+	benches->push_back({"Lexer::eatToken", 1, [](Meter *meter, size_t nIters) {
+		auto source = generateSource(1000);
+		Lexer lexer;
+		lexer.init("bench", source.size() + 1, source.c_str());
+		
+		meter->start();
+		auto nLines = size_t(0);
+		for (auto i = size_t(0); i < nIters; i++) {
+			auto token = lexer.eatToken();
+			if (token.kind == tokenKindEof) {
+				lexer.init("bench", source.size() + 1, source.c_str());
+			}
+			nLines += token.line;
+		}
+		meter->stop();
+		sink = sink + double(nLines);
+		
+		lexer.deinit();
+	}});
+	
+	// Per function compiled, so the time per op stays the
+	// same as inputs grow if compiling scales linearly
+	for (auto nFuncs: {size_t(1000), size_t(8000)}) {
+		benches->push_back({"Compiler::run, per func of " + std::to_string(nFuncs), nFuncs, [nFuncs](Meter *meter, size_t nIters) {
+			auto source = generateSource(nFuncs);
+			Heap heap;
+			heap.init(nullptr);
+			
+			for (auto i = size_t(0); i < nIters; i++) {
+				meter->start();
+				auto func = Compiler{}.run(&heap, "bench", source.size() + 1, source.c_str());
+				meter->stop();
+				
+				if (!func) {
+					exit(1);
+				}
+				clearHeap(&heap);
+			}
+			
+			heap.deinit();
+		}});
+	}
+}
+
+int main(int argc, char **argv) {
+	// Benchmarks whose names contain any of the arguments
+	// are run, or all of them if there are none
+	char const *jsonFile = nullptr;
+	std::vector<char const*> filters;
+	for (auto i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			jsonFile = argv[++i];
+		} else {
+			filters.push_back(argv[i]);
+		}
+	}
+	
+	std::vector<MicroBench> benches;
+	addStructBenches(&benches);
+	addStringBenches(&benches);
+	addArrayBenches(&benches);
+	addCompilerBenches(&benches);
+	
+	auto json = std::string("[\n");
+	
+	printf("%-44s %-12s %-12s %s\n", "name", "ops", "ns/op", "allocs/op");
+	for (auto &bench: benches) {
+		auto isSelected = filters.empty() || std::any_of(filters.begin(), filters.end(), [&](char const *filter) {
+			return bench.name.find(filter) != std::string::npos;
+		});
+		if (!isSelected) {
+			continue;
+		}
+		
+		auto nIters = size_t(1);
+		Meter meter;
+		for (;;) {
+			meter = Meter{};
+			bench.run(&meter, nIters);
+			if (meter.elapsed >= minTime || nIters >= maxIters) {
+				break;
+			}
+			
+			// Aim a little past minTime, growing by at
+			// most 100 times, in case the run was too
+			// short to time well
+			auto scale = meter.elapsed > 0.0? minTime * 1.2 / meter.elapsed : 100.0;
+			nIters = size_t(double(nIters) * std::clamp(scale, 2.0, 100.0));
+		}
+		
+		auto nOps = double(nIters) * double(bench.nOpsPerIter);
+		auto nsPerOp = meter.elapsed * 1e9 / nOps;
+		auto allocsPerOp = double(meter.nAllocs) / nOps;
+		printf("%-44s %-12.0f %-12.2f %.3f\n", bench.name.c_str(), nOps, nsPerOp, allocsPerOp);
+		fflush(stdout);
+		
+		char buf[512];
+		snprintf(buf, sizeof(buf),
+			"%s\t{\"name\": \"%s\", \"ops\": %.0f, \"ns_per_op\": %.3f, \"allocs_per_op\": %.4f}",
+			json.size() > 2? ",\n" : "", bench.name.c_str(), nOps, nsPerOp, allocsPerOp
+		);
+		json += buf;
+	}
+	json += "\n]\n";
+	
+	if (jsonFile) {
+		auto s = fopen(jsonFile, "w");
+		if (!s) {
+			printf("cannot open file '%s' for writing\n", jsonFile);
+			return 1;
+		}
+		fputs(json.c_str(), s);
+		fclose(s);
+	}
+	
+	return 0;
+}
@@ -2,7 +2,10 @@
 import json
 import os
 import platform
+import statistics
 import subprocess
+import sys
+import time
 
 def is_up_to_date(
 	file: str,
@@ -139,19 +142,186 @@ def gen_bin_file(
 	
 	gen_info_file(info_file, cmd, obj_files)
 
+def gen_bundle_file(
+	bundle_file: str,
+	n_funcs: int
+):
+	# A large program that mostly defines functions, few of which
+	# are called, to time compiling and starting it
+	lines = [
+		'',
+		'# Generated by build.py: startup of a large bundle',
+		'# ops: ' + str(n_funcs) + ' functions defined',
+		''
+	]
+	for i in range(n_funcs):
+		lines += [
+			'f' + str(i) + ' = func(a, b) {',
+			'\tvar t = {x = a, y = b, name = "f' + str(i) + '"}',
+			'\tif t.x < t.y {',
+			'\t\treturn t.x * ' + str(i % 97) + ' + t.y',
+			'\t}',
+			'\treturn [t.x, t.y, t.name]',
+			'}'
+		]
+	lines += [
+		'print f0(1, 2) + f' + str(n_funcs - 1) + '(3, 4)',
+		''
+	]
+	
+	os.makedirs(os.path.dirname(bundle_file), exist_ok=True)
+	with open(bundle_file, 'w') as s:
+		s.write('\n'.join(lines))
+
+def read_bench_ops(
+	bench_file: str
+) -> tuple[int, str]:
+	# Each benchmark says how much work it does in a comment
+	# of the form "# ops: N unit"
+	with open(bench_file, 'r') as s:
+		for line in s:
+			if line.startswith('# ops:'):
+				n, unit = line[len('# ops:'):].split(maxsplit=1)
+				return int(n), unit.strip()
+	
+	return 1, 'runs'
+
+def read_peak_rss(
+	pid: int
+) -> int | None:
+	try:
+		with open('/proc/' + str(pid) + '/status', 'r') as s:
+			for line in s:
+				if line.startswith('VmHWM:'):
+					return int(line.split()[1])
+	except OSError:
+		pass
+	
+	return None
+
+def run_bench(
+	bench_file: str,
+	n_runs: int
+) -> tuple[list[float], int | None]:
+	# Processes forked from this one start out with its peak RSS, which
+	# Linux counts towards theirs, so there the peak is sampled from
+	# the process's own memory map instead, in a run of its own so
+	# the sampling isn't timed
+	sample_rss = os.path.exists('/proc/self/status')
+	
+	times = []
+	peak_rss = None
+	for i in range(n_runs + (1 if sample_rss else 0)):
+		start = time.perf_counter()
+		with subprocess.Popen(
+			[scri_file, bench_file],
+			stdout=subprocess.DEVNULL
+		) as p:
+			rss = None
+			if i == n_runs:
+				# The high water mark only grows, so the last
+				# sample before exiting is the peak
+				while p.poll() is None:
+					rss = read_peak_rss(p.pid) or rss
+					time.sleep(0.005)
+			elif hasattr(os, 'wait4'):
+				_, status, usage = os.wait4(p.pid, 0)
+				p.returncode = os.waitstatus_to_exitcode(status)
+				if not sample_rss:
+					# Kilobytes, except on macOS, where it's bytes
+					rss = usage.ru_maxrss
+					if platform.system() == 'Darwin':
+						rss //= 1024
+			else:
+				p.wait()
+		if i < n_runs:
+			times.append(time.perf_counter() - start)
+		
+		if p.returncode != 0:
+			print(bench_file + ' failed with exit code ' + str(p.returncode))
+			exit(-1)
+		
+		if rss is not None:
+			peak_rss = max(peak_rss or 0, rss)
+	
+	return times, peak_rss
+
+def run_benches(
+	names: list[str]
+):
+	n_runs = int(os.environ.get('BENCH_RUNS', '5'))
+	baseline_file = os.environ.get('BENCH_BASELINE')
+	
+	bundle_file = 'gen/bench/bundle.scr'
+	gen_bundle_file(bundle_file, 10000)
+	
+	bench_files = sorted(
+		os.path.join('bench', file)
+		for file in os.listdir('bench') if file.endswith('.scr')
+	) + [bundle_file]
+	if len(names) > 0:
+		bench_files = [file for file in bench_files
+			if os.path.splitext(os.path.basename(file))[0] in names
+		]
+	
+	baseline = {}
+	if baseline_file:
+		with open(baseline_file, 'r') as s:
+			baseline = {bench['name']: bench for bench in json.load(s)['benches']}
+	
+	print('name                   median (s)  ops/s           peak RSS (KB)  change')
+	benches = []
+	for bench_file in bench_files:
+		name = os.path.splitext(os.path.basename(bench_file))[0]
+		n_ops, unit = read_bench_ops(bench_file)
+		times, peak_rss = run_bench(bench_file, n_runs)
+		median = statistics.median(times)
+		
+		bench = {
+			'name': name,
+			'file': bench_file,
+			'ops': n_ops,
+			'unit': unit,
+			'times_s': times,
+			'median_s': median,
+			'ops_per_s': n_ops / median,
+			'peak_rss_kb': peak_rss
+		}
+		benches.append(bench)
+		
+		# Positive when slower than the baseline
+		change = ''
+		if name in baseline:
+			change = '{:+.1f}%'.format(100 * (median / baseline[name]['median_s'] - 1))
+		print('{:<22} {:<11.3f} {:<15.0f} {:<14} {}'.format(
+			name, median, bench['ops_per_s'],
+			'-' if peak_rss is None else peak_rss, change
+		))
+	
+	with open('gen/bench.json', 'w') as s:
+		json.dump({
+			'scri': scri_file,
+			'runs': n_runs,
+			'benches': benches
+		}, s, indent='\t')
+
 c_compiler = os.environ.get('C_COMPILER', 'gcc')
 cpp_compiler = os.environ.get('CPP_COMPILER', 'g++')
 linker = os.environ.get('LINKER', cpp_compiler)
 debug = os.environ.get('DEBUG', '0') != '0'
+opcode_stats = os.environ.get('OPCODE_STATS', '0') != '0'
 
 c_compiler_args = []
 cpp_compiler_args = [
 	'-std=c++20'
 ]
 c_cpp_compiler_args = [
-	'-Isource'
+	'-Isource',
+	'-pthread'
+]
+linker_args = [
+	'-pthread'
 ]
-linker_args = []
 
 if debug:
 	c_cpp_compiler_args += [
@@ -173,10 +343,17 @@ else:
 		'-flto'
 	]
 
+if opcode_stats:
+	c_cpp_compiler_args += [
+		'-DSL_OPCODE_STATS'
+	]
+
 if platform.system() == 'Windows':
 	scri_file = 'gen/scri.exe'
+	microbench_file = 'gen/microbench.exe'
 else:
 	scri_file = 'gen/scri'
+	microbench_file = 'gen/microbench'
 
 compile_commands = []
 
@@ -184,3 +361,15 @@ gen_bin_file(scri_file, ['source'])
 
 with open('gen/compile_commands.json', 'w') as s:
 	json.dump(compile_commands, s)
+
+if len(sys.argv) > 1 and sys.argv[1] == 'bench':
+	run_benches(sys.argv[2:])
+
+if len(sys.argv) > 1 and sys.argv[1] == 'microbench':
+	gen_bin_file(microbench_file, ['bench/micro.cpp', 'source/sl'])
+	
+	r = subprocess.run(
+		[microbench_file, '-j', 'gen/microbench.json'] + sys.argv[2:]
+	).returncode
+	if r != 0:
+		exit(-1)
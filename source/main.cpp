@@ -1,14 +1,25 @@
-
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
 
+#include "sl/allocstats.h"
+#include "sl/collector.h"
 #include "sl/compiler.h"
 #include "sl/heap.h"
-#include "sl/struct.h"
-#include "sl/thread.h"
+#include "sl/isolate.h"
+#include "sl/opstats.h"
+#include "sl/profiler.h"
+#include "sl/scheduler.h"
 #include "sl/val.h"
 
+// Number of allocation sites to print with -a
+static constexpr size_t nPrintedAllocSites = 20;
+
 char *loadString(char const *file, size_t *oNChars) {
 	auto s = fopen(file, "rb");
 	if (!s) {
@@ -28,23 +39,107 @@ char *loadString(char const *file, size_t *oNChars) {
 	return chars;
 }
 
-int main(int argc, char **argv) {
+// Run func in isolate to the end, topping up its fuel
+// with sliceFuel each time it runs out
+void runInSlices(SL::Isolate *isolate, SL::Func *func, size_t sliceFuel) {
+	SL::Val result;
+	isolate->thread->fuel = sliceFuel;
+	isolate->run(func, &result);
+	while (isolate->isSuspended()) {
+		isolate->thread->fuel = sliceFuel;
+		isolate->resume(&result);
+	}
+}
+
+int runOnce(SL::Scheduler *scheduler, SL::Collector *collector, size_t maxHeapBytes, size_t sliceFuel, int nInputs, char **inputs) {
 	using namespace SL;
 	
-	if (argc <= 1) {
-		puts("no inputs");
-		return 1;
+	Isolate isolate;
+	isolate.init(scheduler, collector);
+	isolate.heap.setMaxBytes(maxHeapBytes);
+	
+	for (auto i = 0; i < nInputs; i++) {
+		auto file = inputs[i];
+		
+		size_t nChars;
+		auto chars = loadString(file, &nChars);
+		if (!chars) {
+			return 1;
+		}
+		
+		auto func = isolate.compile(file, nChars + 1, chars);
+		if (!func) {
+			return 1;
+		}
+		
+		runInSlices(&isolate, func, sliceFuel);
+		
+		// Keep script output ordered with any diagnostics
+		// for later inputs
+		isolate.output.flush();
 	}
 	
-	Heap heap;
-	heap.init();
+	// Collect first, so only what's reachable is counted
+	if (isTrackingAllocs) {
+		isolate.heap.collect();
+		
+		fflush(stdout);
+		printHeapCensus(&isolate.heap, stderr, nPrintedAllocSites);
+		fputc('\n', stderr);
+	}
 	
-	auto global = Val::newStruct(Struct::create(&heap, 16));
+	isolate.deinit();
 	
-	auto thread = Thread::create(&heap, global);
+	return 0;
+}
+
+// Run the funcs in each of nCopies isolates on the calling OS thread,
+// the isolates taking turns to burn sliceFuel at a time
+void runCopiesInTurn(SL::Isolate *isolates, size_t nCopies, std::vector<SL::Func*> const &funcs, size_t sliceFuel) {
+	using namespace SL;
 	
-	for (auto i = 1; i < argc; i++) {
-		auto file = argv[i];
+	// Index of the function each copy is running or is to run next
+	std::vector<size_t> funcIdxs(nCopies, 0);
+	auto nRunning = nCopies;
+	while (nRunning > 0) {
+		for (auto i = size_t(0); i < nCopies; i++) {
+			auto isolate = &isolates[i];
+			if (funcIdxs[i] == funcs.size()) {
+				continue;
+			}
+			
+			Val result;
+			isolate->thread->fuel = sliceFuel;
+			if (isolate->isSuspended()) {
+				isolate->resume(&result);
+			} else {
+				isolate->run(funcs[funcIdxs[i]], &result);
+			}
+			
+			if (!isolate->isSuspended()) {
+				funcIdxs[i]++;
+				if (funcIdxs[i] == funcs.size()) {
+					nRunning--;
+				}
+			}
+		}
+	}
+}
+
+// Compile the inputs once, then run nCopies of them at the same time,
+// each in its own isolate on its own OS thread, or all on this one
+// taking turns if sliceFuel is limited
+int runCopies(SL::Scheduler *scheduler, SL::Collector *collector, size_t maxHeapBytes, size_t sliceFuel, size_t nCopies, int nInputs, char **inputs) {
+	using namespace SL;
+	
+	// Compiled functions are shared by all isolates, so they go in a
+	// shared group, held on to here until the isolates are done
+	Heap codeHeap;
+	codeHeap.initShared();
+	
+	std::vector<Func*> funcs;
+	for (auto i = 0; i < nInputs; i++) {
+		auto file = inputs[i];
 		
 		size_t nChars;
 		auto chars = loadString(file, &nChars);
@@ -52,16 +147,212 @@ int main(int argc, char **argv) {
 			return 1;
 		}
 		
-		auto func = Compiler{}.run(&heap, file, nChars + 1, chars);
+		auto func = Compiler{}.run(&codeHeap, file, nChars + 1, chars);
 		if (!func) {
 			return 1;
 		}
+		funcs.push_back(func);
+	}
+	
+	auto startTime = std::chrono::steady_clock::now();
+	
+	if (sliceFuel != SIZE_MAX) {
+		auto isolates = new Isolate[nCopies];
+		for (auto i = size_t(0); i < nCopies; i++) {
+			isolates[i].init(scheduler, collector);
+			isolates[i].heap.setMaxBytes(maxHeapBytes);
+		}
 		
-		Val result;
-		thread->call(func, global, 0, nullptr, &result);
+		runCopiesInTurn(isolates, nCopies, funcs, sliceFuel);
+		
+		for (auto i = size_t(0); i < nCopies; i++) {
+			isolates[i].deinit();
+		}
+		delete[] isolates;
+	} else {
+		std::vector<std::thread> threads;
+		for (auto i = size_t(0); i < nCopies; i++) {
+			threads.emplace_back([scheduler, collector, maxHeapBytes, &funcs]() {
+				Isolate isolate;
+				isolate.init(scheduler, collector);
+				isolate.heap.setMaxBytes(maxHeapBytes);
+				
+				for (auto func: funcs) {
+					Val result;
+					isolate.run(func, &result);
+				}
+				
+				isolate.deinit();
+			});
+		}
+		for (auto &thread: threads) {
+			thread.join();
+		}
 	}
 	
-	heap.deinit();
+	auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	fflush(stdout);
+	fprintf(stderr,
+		"%zu runs in %.3f s (%.1f runs/s)\n",
+		nCopies, secs, double(nCopies) / secs
+	);
+	
+	codeHeap.deinit();
 	
 	return 0;
 }
+
+int main(int argc, char **argv) {
+	auto nCores = size_t(std::thread::hardware_concurrency());
+	if (nCores == 0) {
+		nCores = 1;
+	}
+	
+	auto nCopies = size_t(0);
+	auto isParallel = false;
+	auto nMarkers = nCores;
+	auto isCompacting = false;
+	auto printStats = false;
+	auto maxHeapBytes = SIZE_MAX;
+	auto sliceFuel = SIZE_MAX;
+	char const *profileFile = nullptr;
+	
+	auto argIdx = 1;
+	for (; argIdx < argc && argv[argIdx][0] == '-'; argIdx++) {
+		if (strcmp(argv[argIdx], "-j") == 0) {
+			if (argIdx + 1 >= argc) {
+				puts("expected number of copies after '-j'");
+				return 1;
+			}
+			
+			isParallel = true;
+			nCopies = strtoul(argv[argIdx + 1], nullptr, 10);
+			if (nCopies == 0) {
+				nCopies = nCores;
+			}
+			argIdx++;
+		} else if (strcmp(argv[argIdx], "-m") == 0) {
+			if (argIdx + 1 >= argc) {
+				puts("expected number of marking threads after '-m'");
+				return 1;
+			}
+			
+			nMarkers = strtoul(argv[argIdx + 1], nullptr, 10);
+			if (nMarkers == 0) {
+				nMarkers = nCores;
+			}
+			argIdx++;
+		} else if (strcmp(argv[argIdx], "-l") == 0) {
+			if (argIdx + 1 >= argc) {
+				puts("expected heap limit in megabytes after '-l'");
+				return 1;
+			}
+			
+			auto nMegabytes = strtoul(argv[argIdx + 1], nullptr, 10);
+			if (nMegabytes == 0) {
+				puts("heap limit must be at least 1 megabyte");
+				return 1;
+			}
+			maxHeapBytes = size_t(nMegabytes) << 20;
+			argIdx++;
+		} else if (strcmp(argv[argIdx], "-f") == 0) {
+			if (argIdx + 1 >= argc) {
+				puts("expected fuel per slice after '-f'");
+				return 1;
+			}
+			
+			sliceFuel = strtoul(argv[argIdx + 1], nullptr, 10);
+			if (sliceFuel == 0) {
+				puts("fuel per slice must be at least 1");
+				return 1;
+			}
+			argIdx++;
+		} else if (strcmp(argv[argIdx], "-c") == 0) {
+			isCompacting = true;
+		} else if (strcmp(argv[argIdx], "-s") == 0) {
+			printStats = true;
+		} else if (strcmp(argv[argIdx], "-a") == 0) {
+			SL::isTrackingAllocs = true;
+		} else if (strcmp(argv[argIdx], "-p") == 0) {
+			if (argIdx + 1 >= argc) {
+				puts("expected file to write profile to after '-p'");
+				return 1;
+			}
+			
+			profileFile = argv[argIdx + 1];
+			argIdx++;
+		} else {
+			printf("unknown option '%s'\n", argv[argIdx]);
+			return 1;
+		}
+	}
+	
+	if (argIdx >= argc) {
+		puts("no inputs");
+		return 1;
+	}
+	
+	// One pool of workers for tasks spawned by any script, and one
+	// of helpers for collecting any heap
+	SL::Scheduler scheduler;
+	scheduler.init(nCores);
+	SL::Collector collector;
+	collector.init(nMarkers, isCompacting);
+	
+	// Sampled a thousand times a second of CPU time
+	SL::Profiler profiler;
+	if (profileFile) {
+		profiler.init();
+		if (!profiler.start(1000)) {
+			puts("profiling is not supported on this platform");
+			return 1;
+		}
+	}
+	
+	int r;
+	if (isParallel) {
+		r = runCopies(&scheduler, &collector, maxHeapBytes, sliceFuel, nCopies, argc - argIdx, argv + argIdx);
+	} else {
+		r = runOnce(&scheduler, &collector, maxHeapBytes, sliceFuel, argc - argIdx, argv + argIdx);
+	}
+	
+	if (profileFile) {
+		profiler.stop();
+		
+		auto s = fopen(profileFile, "w");
+		if (s) {
+			profiler.writeFolded(s);
+			fclose(s);
+		} else {
+			printf("cannot open file '%s' for writing", profileFile);
+		}
+		
+		if (profiler.getNDroppedSamples() > 0) {
+			fprintf(stderr, "profile full, %zu of %zu samples dropped\n",
+				profiler.getNDroppedSamples(),
+				profiler.getNSamples() + profiler.getNDroppedSamples()
+			);
+		}
+		profiler.deinit();
+	}
+	
+	if (SL::isTrackingAllocs) {
+		fflush(stdout);
+		SL::printAllocStats(stderr, nPrintedAllocSites);
+	}
+	
+	if (printStats) {
+		fflush(stdout);
+		scheduler.printStats(stderr);
+		collector.printStats(stderr);
+	}
+	
+#ifdef SL_OPCODE_STATS
+	fflush(stdout);
+	SL::printOpStats(stderr);
+#endif
+	scheduler.deinit();
+	collector.deinit();
+	
+	return r;
+}
@@ -0,0 +1,295 @@
+#include "allocstats.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "collector.h"
+#include "func.h"
+#include "funcinfo.h"
+#include "profiler.h"
+#include "thread.h"
+
+namespace SL {
+	std::atomic<bool> isTrackingAllocs = false;
+	
+	static char const *objectTypeNames[] = {
+		"string",
+		"array",
+		"struct",
+		"func",
+		"thread",
+		"channel",
+	};
+	static_assert(sizeof(objectTypeNames) / sizeof(objectTypeNames[0]) == nObjectTypes);
+	
+	// Keyed on the function's info rather than the function, which may
+	// be freed, and its memory reused, long before the stats are written
+	struct AllocSite {
+		uint32_t funcInfo;
+		size_t line;
+		
+		bool operator==(AllocSite const &other) const {
+			return funcInfo == other.funcInfo && line == other.line;
+		}
+	};
+	
+	struct AllocSiteHash {
+		size_t operator()(AllocSite const &site) const {
+			return std::hash<uint32_t>()(site.funcInfo) ^ (site.line * 0x9e3779b97f4a7c15);
+		}
+	};
+	
+	struct AllocCounts {
+		uint64_t nObjects, nBuffers, nBytes;
+	};
+	
+	// Counts for the allocations made on one OS thread, by site and
+	// type. Only that thread writes them, and they're only read once
+	// no scripts are running, so need no locking.
+	struct AllocStats {
+		// Sites already numbered, saving taking the lock for them
+		std::unordered_map<AllocSite, uint16_t, AllocSiteHash> siteIdxs;
+		std::vector<AllocCounts> counts;
+		
+		AllocCounts *getCounts(uint16_t site, ObjectType type) {
+			auto idx = size_t(site) * nObjectTypes + type;
+			if (idx >= counts.size()) {
+				counts.resize(idx + 1, AllocCounts{});
+			}
+			return &counts[idx];
+		}
+	};
+	
+	struct HeapCensus {
+		size_t nBytes;
+		// Indexed by site * nObjectTypes + type
+		std::vector<AllocCounts> counts;
+	};
+	
+	// Sites numbered so far, by number, with the noAllocSite first
+	static std::mutex allSitesMutex;
+	static std::vector<AllocSite> allSites = {AllocSite{nativeFuncInfo, 0}};
+	static std::unordered_map<AllocSite, uint16_t, AllocSiteHash> allSiteIdxs;
+	
+	// Stats of every OS thread that has allocated, kept after
+	// the thread exits so its counts still add up
+	static std::mutex allStatsMutex;
+	static std::vector<AllocStats*> allStats;
+	
+	static thread_local AllocStats *threadStats = nullptr;
+	
+	static AllocStats *getThreadStats() {
+		if (!threadStats) {
+			threadStats = new AllocStats();
+			std::lock_guard<std::mutex> lock(allStatsMutex);
+			allStats.push_back(threadStats);
+		}
+		return threadStats;
+	}
+	
+	// Site of the op the thread running on this OS thread is at. Ops that
+	// allocate make sure the top call points at them, and a native
+	// function allocating is at the op after the one that called it,
+	// which was compiled from the same line.
+	static uint16_t getSite(AllocStats *stats) {
+		auto thread = runningThread;
+		if (!thread || thread->callStack.len == 0) {
+			return noAllocSite;
+		}
+		
+		auto call = &thread->callStack.buf[thread->callStack.len - 1];
+		auto site = AllocSite{call->func->info, call->func->getLine(size_t(call->opIt - call->func->ops))};
+		
+		auto it = stats->siteIdxs.find(site);
+		if (it != stats->siteIdxs.end()) {
+			return it->second;
+		}
+		
+		uint16_t r;
+		{
+			std::lock_guard<std::mutex> lock(allSitesMutex);
+			auto allIt = allSiteIdxs.find(site);
+			if (allIt != allSiteIdxs.end()) {
+				r = allIt->second;
+			} else if (allSites.size() < otherAllocSite) {
+				r = uint16_t(allSites.size());
+				allSites.push_back(site);
+				allSiteIdxs[site] = r;
+			} else {
+				r = otherAllocSite;
+			}
+		}
+		stats->siteIdxs[site] = r;
+		return r;
+	}
+	
+	uint16_t recordObjectAlloc(ObjectType type, size_t nBytes) {
+		auto stats = getThreadStats();
+		auto site = getSite(stats);
+		auto counts = stats->getCounts(site, type);
+		counts->nObjects++;
+		counts->nBytes += nBytes;
+		return site;
+	}
+	
+	void recordBufferAlloc(ObjectType type, size_t nBytes) {
+		auto stats = getThreadStats();
+		auto counts = stats->getCounts(getSite(stats), type);
+		counts->nBuffers++;
+		counts->nBytes += nBytes;
+	}
+	
+	static std::string getSiteName(uint16_t site) {
+		if (site == noAllocSite) {
+			return "<outside scripts>";
+		} else if (site == otherAllocSite) {
+			return "<other sites>";
+		}
+		
+		AllocSite s;
+		{
+			std::lock_guard<std::mutex> lock(allSitesMutex);
+			s = allSites[site];
+		}
+		
+		auto r = std::string();
+		appendFuncLocation(&r, s.funcInfo, s.line);
+		return r;
+	}
+	
+	static double getShare(uint64_t n, uint64_t total) {
+		return total > 0? 100.0 * double(n) / double(total) : 0.0;
+	}
+	
+	// Print the counts by type, then the nSites sites and types with
+	// the most bytes. counts holds the counts for each site and type,
+	// indexed by site * nObjectTypes + type.
+	static void printCounts(FILE *stream, std::vector<AllocCounts> const &counts, size_t nSites, bool hasBuffers) {
+		AllocCounts totals[nObjectTypes] = {};
+		auto total = AllocCounts{};
+		std::vector<size_t> order;
+		for (auto i = size_t(0); i < counts.size(); i++) {
+			auto c = &counts[i];
+			if (c->nObjects == 0 && c->nBuffers == 0) {
+				continue;
+			}
+			order.push_back(i);
+			
+			auto t = &totals[i % nObjectTypes];
+			t->nObjects += c->nObjects;
+			t->nBuffers += c->nBuffers;
+			t->nBytes += c->nBytes;
+			total.nObjects += c->nObjects;
+			total.nBuffers += c->nBuffers;
+			total.nBytes += c->nBytes;
+		}
+		
+		auto printRow = [&](char const *name, AllocCounts const *c) {
+			fprintf(stream, "%-9s %-14llu ", name, (unsigned long long)c->nObjects);
+			if (hasBuffers) {
+				fprintf(stream, "%-14llu ", (unsigned long long)c->nBuffers);
+			}
+			fprintf(stream, "%-14llu %5.1f%%\n", (unsigned long long)c->nBytes, getShare(c->nBytes, total.nBytes));
+		};
+		
+		fprintf(stream, hasBuffers?
+			"type      objects        buffers        bytes          share\n" :
+			"type      objects        bytes          share\n"
+		);
+		for (auto i = size_t(0); i < nObjectTypes; i++) {
+			if (totals[i].nObjects > 0 || totals[i].nBuffers > 0) {
+				printRow(objectTypeNames[i], &totals[i]);
+			}
+		}
+		printRow("total", &total);
+		
+		// Most bytes first
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return counts[a].nBytes > counts[b].nBytes;
+		});
+		if (order.size() > nSites) {
+			order.resize(nSites);
+		}
+		
+		fprintf(stream, hasBuffers?
+			"\ntype      objects        buffers        bytes          share   site\n" :
+			"\ntype      objects        bytes          share   site\n"
+		);
+		for (auto i: order) {
+			auto c = &counts[i];
+			fprintf(stream, "%-9s %-14llu ", objectTypeNames[i % nObjectTypes], (unsigned long long)c->nObjects);
+			if (hasBuffers) {
+				fprintf(stream, "%-14llu ", (unsigned long long)c->nBuffers);
+			}
+			fprintf(stream, "%-14llu %5.1f%%  %s\n",
+				(unsigned long long)c->nBytes, getShare(c->nBytes, total.nBytes),
+				getSiteName(uint16_t(i / nObjectTypes)).c_str()
+			);
+		}
+	}
+	
+	void printAllocStats(FILE *stream, size_t nSites) {
+		std::vector<AllocCounts> counts;
+		{
+			std::lock_guard<std::mutex> lock(allStatsMutex);
+			for (auto stats: allStats) {
+				if (stats->counts.size() > counts.size()) {
+					counts.resize(stats->counts.size(), AllocCounts{});
+				}
+				for (auto i = size_t(0); i < stats->counts.size(); i++) {
+					counts[i].nObjects += stats->counts[i].nObjects;
+					counts[i].nBuffers += stats->counts[i].nBuffers;
+					counts[i].nBytes += stats->counts[i].nBytes;
+				}
+			}
+		}
+		
+		fprintf(stream, "allocated\n");
+		printCounts(stream, counts, nSites, true);
+	}
+	
+	void updateHeapCensus(Heap *heap) {
+		if (!isTrackingAllocs.load(std::memory_order_relaxed) ||
+			(heap->peakCensus && heap->liveBytes <= heap->peakCensus->nBytes)
+		) {
+			return;
+		}
+		
+		// Wait for the sweep, after which only what was
+		// reachable is left in the list
+		if (heap->collector) {
+			heap->collector->finishSweep(heap);
+		}
+		
+		if (!heap->peakCensus) {
+			heap->peakCensus = new HeapCensus();
+		}
+		auto census = heap->peakCensus;
+		census->nBytes = heap->liveBytes;
+		census->counts.clear();
+		for (auto object = heap->objects; object; object = object->next) {
+			auto idx = size_t(object->allocSite) * nObjectTypes + object->type;
+			if (idx >= census->counts.size()) {
+				census->counts.resize(idx + 1, AllocCounts{});
+			}
+			census->counts[idx].nObjects++;
+			census->counts[idx].nBytes += getObjectSize(object);
+		}
+	}
+	
+	void destroyHeapCensus(HeapCensus *census) {
+		delete census;
+	}
+	
+	void printHeapCensus(Heap *heap, FILE *stream, size_t nSites) {
+		if (!heap->peakCensus) {
+			return;
+		}
+		
+		fprintf(stream, "reachable at peak\n");
+		printCounts(stream, heap->peakCensus->counts, nSites, false);
+	}
+}
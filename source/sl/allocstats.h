@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "heap.h"
+
+namespace SL {
+	// objectTypeChannel is the last object type
+	static constexpr size_t nObjectTypes = size_t(objectTypeChannel) + 1;
+	
+	// Site of allocations made outside of script functions, by the
+	// compiler or the host, and of those made once there are too
+	// many sites to tell apart
+	static constexpr uint16_t noAllocSite = 0;
+	static constexpr uint16_t otherAllocSite = UINT16_MAX;
+	
+	// Whether allocations are being counted, by the type of object they
+	// are for and the site (script function and line) they were made
+	// from. Only to be changed while no scripts are running. Objects
+	// keep the site they were created at, for censuses of heaps.
+	extern std::atomic<bool> isTrackingAllocs;
+	
+	uint16_t recordObjectAlloc(ObjectType type, size_t nBytes);
+	void recordBufferAlloc(ObjectType type, size_t nBytes);
+	
+	// Count an object of nBytes being created, returning
+	// the site to keep in it
+	inline uint16_t trackObjectAlloc(ObjectType type, size_t nBytes) {
+		return isTrackingAllocs.load(std::memory_order_relaxed)?
+			recordObjectAlloc(type, nBytes) : noAllocSite;
+	}
+	
+	// Count a buffer being allocated for an object of type
+	inline void trackBufferAlloc(ObjectType type, size_t nBytes) {
+		if (isTrackingAllocs.load(std::memory_order_relaxed)) {
+			recordBufferAlloc(type, nBytes);
+		}
+	}
+	
+	// Take a census of the heap, just after it's been collected, if
+	// more bytes were found reachable than by the one it has
+	void updateHeapCensus(Heap *heap);
+	void destroyHeapCensus(HeapCensus *census);
+	
+	// Print the objects and buffers allocated and the bytes they took
+	// by type, then the nSites sites and types that took the most,
+	// totalled over every OS thread, while no scripts are running
+	void printAllocStats(FILE *stream, size_t nSites);
+	// Print the number of objects in the heap's census and the bytes
+	// they held by type, then for the nSites sites and types holding
+	// the most
+	void printHeapCensus(Heap *heap, FILE *stream, size_t nSites);
+}
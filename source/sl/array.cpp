@@ -1,13 +1,18 @@
 #include "array.h"
 
+#include "allocstats.h"
 #include "val.h"
 
 namespace SL {
 	Array *Array::create(Heap *heap, size_t nElems) {
+		// Reserved first, so there's no array left
+		// half made if the heap can't hold it
+		heap->reserveBytes(sizeof(Val) * nElems);
 		auto r = (Array*)heap->createObject(sizeof(Array), objectTypeArray);
 		r->bufLen = nElems;
 		r->nElems = nElems;
 		r->elems = new Val[nElems];
+		trackBufferAlloc(objectTypeArray, sizeof(Val) * nElems);
 		
 		return r;
 	}
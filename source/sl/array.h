@@ -9,6 +9,12 @@ namespace SL {
 		size_t bufLen, nElems;
 		Val *elems;
 		
+		// Elements are stored inline after the header in arrays
+		// compacted into a region, and allocated separately otherwise
+		bool hasInlineElems() const {
+			return isInRegion && (void*)elems == (void*)(this + 1);
+		}
+		
 		static Array *create(Heap *heap, size_t nElems);
 	};
 }
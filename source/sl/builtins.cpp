@@ -0,0 +1,411 @@
+#include "builtins.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "array.h"
+#include "channel.h"
+#include "copy.h"
+#include "freeze.h"
+#include "func.h"
+#include "scheduler.h"
+#include "sort.h"
+#include "struct.h"
+#include "thread.h"
+#include "val.h"
+
+namespace SL {
+	// Orderings used when sorting without a comparator. Values are
+	// grouped by type, numbers are ascending with NaNs last, strings
+	// are ordered bytewise, and other objects by address.
+	
+	static bool numberLess(double a, double b) {
+		return a < b || (std::isnan(b) && !std::isnan(a));
+	}
+	
+	static bool stringLess(String *a, String *b) {
+		auto nChars = (a->nChars < b->nChars)? a->nChars : b->nChars;
+		auto c = memcmp(a->getChars(), b->getChars(), nChars);
+		return c < 0 || (c == 0 && a->nChars < b->nChars);
+	}
+	
+	static bool valLess(Val a, Val b) {
+		if (a.type != b.type) {
+			return a.type < b.type;
+		} else if (a.isNumber()) {
+			return numberLess(a.numberVal, b.numberVal);
+		} else if (a.isString()) {
+			return stringLess(a.stringVal, b.stringVal);
+		} else {
+			return uintptr_t(a.ptrVal) < uintptr_t(b.ptrVal);
+		}
+	}
+	
+	// array(n) creates an array of n nils
+	static bool nativeArray(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto nVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!nVal.isNumber() || !(nVal.numberVal >= 0.0) ||
+			nVal.numberVal != trunc(nVal.numberVal) ||
+			nVal.numberVal > double(PTRDIFF_MAX / sizeof(Val))
+		) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		auto nElems = size_t(nVal.numberVal);
+		thread->heap->makeRoom(sizeof(Array) + sizeof(Val) * nElems);
+		auto r = Array::create(thread->heap, nElems);
+		for (auto i = size_t(0); i < nElems; i++) {
+			r->elems[i] = Val::newNil();
+		}
+		
+		*oResult = Val::newArray(r);
+		return true;
+	}
+	
+	// sort(array, less) sorts an array in place and returns it.
+	// less(a, b) is optional, and should return true if a must
+	// come before b. Sorting a frozen array aborts the script.
+	static bool nativeSort(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto arrayVal = (nArgs > 0)? args[0] : Val::newNil();
+		auto lessVal = (nArgs > 1)? args[1] : Val::newNil();
+		
+		if (!arrayVal.isArray()) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		if (arrayVal.arrayVal->isFrozen) {
+			thread->reportError("can't sort a frozen array");
+			return false;
+		}
+		
+		*oResult = arrayVal;
+		
+		auto array = arrayVal.arrayVal;
+		auto elems = array->elems;
+		auto nElems = array->nElems;
+		
+		if (lessVal.isFunc()) {
+			auto lessFunc = lessVal.funcVal;
+			
+			// Once the comparator fails, stop calling it and
+			// let the sort run out
+			auto failed = false;
+			sort(elems, elems + nElems, [&](Val a, Val b) {
+				if (failed) {
+					return false;
+				}
+				
+				Val lessArgs[] = {a, b};
+				Val r;
+				if (!thread->call(lessFunc, inst, 2, lessArgs, &r)) {
+					failed = true;
+					return false;
+				}
+				return r.asBool();
+			});
+			
+			return !failed;
+		}
+		
+		auto allNumbers = true, allStrings = true;
+		for (auto i = size_t(0); i < nElems; i++) {
+			allNumbers = allNumbers && elems[i].isNumber();
+			allStrings = allStrings && elems[i].isString();
+		}
+		
+		// For arrays of a single type, sort the raw payloads
+		// so comparisons don't need to dispatch on type
+		if (allNumbers) {
+			auto numbers = new double[nElems];
+			for (auto i = size_t(0); i < nElems; i++) {
+				numbers[i] = elems[i].numberVal;
+			}
+			
+			sort(numbers, numbers + nElems, numberLess);
+			
+			for (auto i = size_t(0); i < nElems; i++) {
+				elems[i] = Val::newNumber(numbers[i]);
+			}
+			delete[] numbers;
+		} else if (allStrings) {
+			// Flattening allocates, so can run into the heap's
+			// limit, which mustn't happen while holding a buffer
+			for (auto i = size_t(0); i < nElems; i++) {
+				elems[i].stringVal->flatten();
+			}
+			
+			auto strings = new String*[nElems];
+			for (auto i = size_t(0); i < nElems; i++) {
+				strings[i] = elems[i].stringVal;
+			}
+			
+			sort(strings, strings + nElems, stringLess);
+			
+			for (auto i = size_t(0); i < nElems; i++) {
+				elems[i] = Val::newString(strings[i]);
+			}
+			delete[] strings;
+		} else {
+			sort(elems, elems + nElems, valLess);
+		}
+		
+		return true;
+	}
+	
+	// coroutine(f, ...) creates a coroutine that calls f when first
+	// resumed, with any further arguments as f's arguments
+	static bool nativeCoroutine(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto funcVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!funcVal.isFunc() || funcVal.funcVal->native) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		*oResult = Val::newThread(Thread::createCoroutine(thread, funcVal.funcVal, inst, nArgs - 1, args + 1));
+		return true;
+	}
+	
+	// resume(co, val) runs a coroutine until it yields or returns, and
+	// returns the value yielded or returned. val is optional, and is
+	// the result of the yield that resumes (so is unused by the first
+	// resume).
+	static bool nativeResume(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto coVal = (nArgs > 0)? args[0] : Val::newNil();
+		auto val = (nArgs > 1)? args[1] : Val::newNil();
+		
+		// Finished and running coroutines (including any
+		// resuming this one) can't be resumed
+		if (!coVal.isThread() || !coVal.threadVal->isCoroutine ||
+			coVal.threadVal->state != threadStateSuspended
+		) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		return coVal.threadVal->resume(val, oResult);
+	}
+	
+	// yield(val) suspends the running coroutine, making the resume that
+	// ran it return val. Does nothing outside of a coroutine, or when
+	// called by a native function.
+	static bool nativeYield(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		*oResult = (nArgs > 0)? args[0] : Val::newNil();
+		if (!thread->yield()) {
+			*oResult = Val::newNil();
+		}
+		return true;
+	}
+	
+	// done(co) returns whether a coroutine has returned
+	static bool nativeDone(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto coVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!coVal.isThread() || !coVal.threadVal->isCoroutine) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		*oResult = Val::fromBool(coVal.threadVal->state == threadStateDone);
+		return true;
+	}
+	
+	// spawn(f, ...) calls f in parallel, with copies of any further
+	// arguments, and returns a handle to pass to join. f can call other
+	// top-level functions and see frozen globals, but sees no others.
+	static bool nativeSpawn(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto funcVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!funcVal.isFunc()) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		auto r = Thread::createTask(thread, funcVal.funcVal, nArgs - 1, args + 1);
+		if (thread->scheduler) {
+			thread->scheduler->spawn(r->task);
+		} else {
+			Scheduler::runTask(r->task, thread->output);
+		}
+		
+		*oResult = Val::newThread(r);
+		return true;
+	}
+	
+	// join(handle) waits for a spawned function to return, and returns
+	// a copy of its result. Each handle can only be joined once.
+	static bool nativeJoin(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto handleVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!handleVal.isThread() || !handleVal.threadVal->task) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		return handleVal.threadVal->join(thread, oResult);
+	}
+	
+	// freeze(v) makes v and everything reachable from it immutable, and
+	// returns it. Frozen values are shared with spawned functions and
+	// sent over channels without copying. Returns nil, freezing
+	// nothing, if a coroutine or task handle is reachable.
+	static bool nativeFreeze(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto val = (nArgs > 0)? args[0] : Val::newNil();
+		
+		*oResult = freezeVal(val)? val : Val::newNil();
+		return true;
+	}
+	
+	// channel(capacity) creates a channel holding up to capacity values
+	// (rounded up to a power of 2), 64 if not given. Channels can be
+	// passed to spawned functions, and are shared rather than copied.
+	static bool nativeChannel(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto capacityVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		auto capacity = size_t(64);
+		if (capacityVal.isNumber()) {
+			if (!(capacityVal.numberVal >= 1.0 && capacityVal.numberVal <= double(1 << 30))) {
+				*oResult = Val::newNil();
+				return true;
+			}
+			capacity = size_t(capacityVal.numberVal);
+		}
+		
+		auto ch = Channel::create(capacity);
+		thread->heap->holdSharedGroup(ch->group);
+		*oResult = Val::newChannel(ch);
+		return true;
+	}
+	
+	// send(ch, val) sends val to a channel, waiting while it is full,
+	// and returns whether it was sent (it isn't if the channel is
+	// closed). Strings are sent by reference and arrays are moved, so
+	// the sender is left with empty arrays (see moveVal).
+	//
+	// A spawned function that has to wait is suspended, so the OS thread
+	// running it can run other tasks. Elsewhere, waiting just yields the
+	// OS thread. It doesn't run other tasks the way join does, as a task
+	// run that way could only return once the wait was over, and may be
+	// what the wait is for.
+	static bool nativeSend(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto chVal = (nArgs > 0)? args[0] : Val::newNil();
+		auto val = (nArgs > 1)? args[1] : Val::newNil();
+		
+		if (!chVal.isChannel()) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		auto ch = chVal.channelVal;
+		if (ch->isClosed.load(std::memory_order_acquire)) {
+			*oResult = Val::fromBool(false);
+			return true;
+		}
+		
+		val = moveVal(thread->heap, val);
+		while (!ch->trySend(val)) {
+			if (ch->isClosed.load(std::memory_order_acquire)) {
+				// Take back what wasn't sent
+				thread->heap->adopt(val);
+				*oResult = Val::fromBool(false);
+				return true;
+			}
+			
+			if (thread->task && thread->scheduler && thread->yield()) {
+				// The scheduler finishes the send before resuming
+				auto task = thread->task;
+				task->waitChannel = ch;
+				task->isWaitingToSend = true;
+				task->waitVal = val;
+				*oResult = Val::newNil();
+				return true;
+			}
+			
+			std::this_thread::yield();
+		}
+		
+		*oResult = Val::fromBool(true);
+		return true;
+	}
+	
+	// receive(ch) receives the next value sent to a channel, waiting
+	// while it is empty. Returns nil once it is closed and empty.
+	static bool nativeReceive(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto chVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (!chVal.isChannel()) {
+			*oResult = Val::newNil();
+			return true;
+		}
+		
+		auto ch = chVal.channelVal;
+		while (!ch->tryReceive(oResult)) {
+			// Check for values sent before closing once more
+			// after seeing it closed
+			if (ch->isClosed.load(std::memory_order_acquire)) {
+				if (ch->tryReceive(oResult)) {
+					thread->heap->adopt(*oResult);
+				} else {
+					*oResult = Val::newNil();
+				}
+				return true;
+			}
+			
+			if (thread->task && thread->scheduler && thread->yield()) {
+				// The scheduler finishes the receive before resuming
+				auto task = thread->task;
+				task->waitChannel = ch;
+				task->isWaitingToSend = false;
+				*oResult = Val::newNil();
+				return true;
+			}
+			
+			std::this_thread::yield();
+		}
+		
+		thread->heap->adopt(*oResult);
+		return true;
+	}
+	
+	// close(ch) closes a channel, so no more values can be sent to it
+	static bool nativeClose(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult) {
+		auto chVal = (nArgs > 0)? args[0] : Val::newNil();
+		
+		if (chVal.isChannel()) {
+			chVal.channelVal->isClosed.store(true, std::memory_order_release);
+		}
+		
+		*oResult = Val::newNil();
+		return true;
+	}
+	
+	void addBuiltins(Heap *heap, Struct *global) {
+		static struct {
+			char const *name;
+			NativeFn native;
+		} const builtins[] = {
+			{"array", nativeArray},
+			{"sort", nativeSort},
+			{"coroutine", nativeCoroutine},
+			{"resume", nativeResume},
+			{"yield", nativeYield},
+			{"done", nativeDone},
+			{"spawn", nativeSpawn},
+			{"join", nativeJoin},
+			{"channel", nativeChannel},
+			{"send", nativeSend},
+			{"receive", nativeReceive},
+			{"close", nativeClose},
+			{"freeze", nativeFreeze},
+		};
+		
+		for (auto &b : builtins) {
+			auto key = String::create(heap, strlen(b.name), b.name);
+			global->set(key, Val::newFunc(Func::createNative(heap, b.native)));
+		}
+	}
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "heap.h"
+
+namespace SL {
+	struct Struct;
+	
+	// Add the functions provided by the runtime
+	// to a struct of globals
+	void addBuiltins(Heap *heap, Struct *global);
+}
@@ -0,0 +1,86 @@
+#include "channel.h"
+
+#include <cassert>
+#include <cstdint>
+
+namespace SL {
+	bool Channel::trySend(Val val) {
+		auto pos = sendPos.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;) {
+			cell = &cells[pos & (nCells - 1)];
+			auto seq = cell->seq.load(std::memory_order_acquire);
+			auto diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0) {
+				// The cell is free in this lap, claim it
+				if (sendPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// The cell still holds a value from the previous lap
+				return false;
+			} else {
+				// Another sender claimed the cell first
+				pos = sendPos.load(std::memory_order_relaxed);
+			}
+		}
+		
+		cell->val = val;
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	
+	bool Channel::tryReceive(Val *oVal) {
+		auto pos = receivePos.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;) {
+			cell = &cells[pos & (nCells - 1)];
+			auto seq = cell->seq.load(std::memory_order_acquire);
+			auto diff = intptr_t(seq) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (receivePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// Nothing sent to the cell in this lap yet
+				return false;
+			} else {
+				pos = receivePos.load(std::memory_order_relaxed);
+			}
+		}
+		
+		*oVal = cell->val;
+		// Free the cell for the next lap
+		cell->seq.store(pos + nCells, std::memory_order_release);
+		return true;
+	}
+	
+	Channel *Channel::create(size_t capacity) {
+		auto nCells = size_t(2);
+		while (nCells < capacity) {
+			assert(nCells <= SIZE_MAX/2);
+			nCells *= 2;
+		}
+		
+		auto r = new Channel;
+		r->type = objectTypeChannel;
+		r->isFrozen = false;
+		r->owner = objectOwnerShared;
+		r->isMarked.store(false, std::memory_order_relaxed);
+		r->isInRegion = false;
+		r->isForwarded = false;
+		r->group = SharedGroup::create();
+		r->group->objects.push(r);
+		r->nCells = nCells;
+		r->cells = new Cell[nCells];
+		for (auto i = size_t(0); i < nCells; i++) {
+			r->cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+		r->sendPos.store(0, std::memory_order_relaxed);
+		r->receivePos.store(0, std::memory_order_relaxed);
+		r->isClosed.store(false, std::memory_order_relaxed);
+		r->group->nBytes = getObjectSize(r);
+		
+		return r;
+	}
+}
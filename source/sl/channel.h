@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "heap.h"
+#include "val.h"
+
+namespace SL {
+	// Bounded queue of values that any number of threads can send to
+	// and receive from at once, without locking (Vyukov's bounded MPMC
+	// queue). Each cell's sequence number says whether it is ready to
+	// be sent to or received from in the current lap of the ring.
+	//
+	// Channels are shared by the threads using them, so belong to no
+	// heap, but to a shared group of their own, freed once no heap
+	// reaches it. Values sent hold their own references to groups, so
+	// a channel that reaches itself through the values in it is never
+	// freed.
+	struct Channel : public Object {
+		struct Cell {
+			std::atomic<size_t> seq;
+			Val val;
+		};
+		
+		// Power of 2
+		size_t nCells;
+		Cell *cells;
+		
+		// Kept on separate cache lines, as senders and
+		// receivers update them from different threads
+		alignas(64) std::atomic<size_t> sendPos;
+		alignas(64) std::atomic<size_t> receivePos;
+		alignas(64) std::atomic<bool> isClosed;
+		
+		// Values sent should already be safe for other threads to use
+		// (see moveVal). Returns false if the channel is full.
+		bool trySend(Val val);
+		// Returns false if the channel is empty
+		bool tryReceive(Val *oVal);
+		
+		// Holds at least capacity values. The caller is given the
+		// only reference to the channel's group.
+		static Channel *create(size_t capacity);
+	};
+}
@@ -0,0 +1,655 @@
+#include "collector.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+
+#include "array.h"
+#include "compact.h"
+#include "func.h"
+#include "struct.h"
+#include "thread.h"
+#include "val.h"
+
+namespace SL {
+	// Arrays and structs with more elements or slots than this
+	// are scanned in slices of this many
+	static constexpr size_t sliceLen = 4096;
+	
+	// Heaps with fewer objects than this are marked without help,
+	// as waking the helpers would take about as long
+	static constexpr size_t minSharedMarkObjects = size_t(1) << 16;
+	
+	// Fragmentation from which heaps are compacted. Heaps are collected
+	// once they have doubled, so half of what they hold being garbage
+	// is to be expected, and the memory is soon reused.
+	static constexpr double compactFragmentation = 0.75;
+	
+	struct MarkJob {
+		Heap *heap;
+		size_t nMarkers;
+		Marker *markers;
+		
+		// Number of markers with something to scan, or trying to steal
+		// something. Markers only queue objects while counted, so once
+		// none are, everything reachable has been marked.
+		std::atomic<size_t> nActive;
+	};
+	
+	static int64_t nsSince(std::chrono::steady_clock::time_point time) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - time
+		).count();
+	}
+	
+	// Mark the object val references, if it belongs to the heap and
+	// isn't marked yet, queueing it to be scanned if it has references
+	static void markVal(Marker *marker, Val val) {
+		switch (val.type) {
+		case typeString:
+		case typeArray:
+		case typeStruct:
+		case typeFunc:
+		case typeThread:
+		case typeChannel: {
+			break;
+		}
+		default: {
+			return;
+		}
+		}
+		
+		auto object = (Object*)val.ptrVal;
+		if (object->owner == objectOwnerShared) {
+			auto groups = &marker->sharedGroups;
+			if (groups->len == 0 || groups->buf[groups->len - 1] != object->group) {
+				groups->push(object->group);
+			}
+			return;
+		}
+		if (object->owner == objectOwnerTransit) {
+			return;
+		}
+		if (object->isMarked.load(std::memory_order_relaxed) ||
+			object->isMarked.exchange(true, std::memory_order_relaxed)
+		) {
+			return;
+		}
+		marker->nMarked++;
+		marker->nMarkedBytes += getObjectSize(object);
+		
+		if (val.isString() && val.stringVal->isFlat()) {
+			return;
+		}
+		marker->deque.push(uintptr_t(object));
+	}
+	
+	static void scanVals(Marker *marker, size_t nVals, Val const *vals) {
+		for (auto i = size_t(0); i < nVals; i++) {
+			markVal(marker, vals[i]);
+		}
+	}
+	
+	static void scanSlots(Marker *marker, Struct *s, size_t begin, size_t end) {
+		for (auto i = begin; i < end; i++) {
+			if (s->slotIsOccupied(i)) {
+				markVal(marker, Val::newString(s->keys[i]));
+				markVal(marker, s->vals[i]);
+			}
+		}
+	}
+	
+	// Queue a large array or struct in slices, to be scanned
+	// by whichever markers get to them
+	static void pushSlices(Marker *marker, Object *object, size_t len) {
+		auto nSlices = (len + sliceLen - 1) / sliceLen;
+		auto slices = new MarkSlice[nSlices];
+		marker->sliceBufs.push(slices);
+		
+		for (auto i = size_t(0); i < nSlices; i++) {
+			auto end = (i + 1) * sliceLen;
+			slices[i] = MarkSlice{
+				.object = object,
+				.begin = i * sliceLen,
+				.end = (end < len)? end : len
+			};
+			marker->deque.push(uintptr_t(&slices[i]) | 1);
+		}
+	}
+	
+	static void scanThread(Marker *marker, Heap *heap, Thread *thread) {
+		// A task's thread is its handle in the spawner's heap, but
+		// what it holds belongs to the task's heap
+		if (thread->heap != heap) {
+			return;
+		}
+		
+		markVal(marker, thread->global);
+		scanVals(marker, thread->stack.len, thread->stack.buf);
+		for (auto i = size_t(0); i < thread->callStack.len; i++) {
+			auto call = &thread->callStack.buf[i];
+			markVal(marker, Val::newFunc(call->func));
+			markVal(marker, call->inst);
+		}
+		
+		if (thread->entryFunc) {
+			markVal(marker, Val::newFunc(thread->entryFunc));
+		}
+		markVal(marker, thread->entryInst);
+		if (thread->entryArgs) {
+			markVal(marker, Val::newArray(thread->entryArgs));
+		}
+	}
+	
+	static void scan(Marker *marker, Heap *heap, uintptr_t item) {
+		if (item & 1) {
+			auto slice = (MarkSlice*)(item & ~uintptr_t(1));
+			if (slice->object->type == objectTypeArray) {
+				auto array = (Array*)slice->object;
+				scanVals(marker, slice->end - slice->begin, array->elems + slice->begin);
+			} else {
+				scanSlots(marker, (Struct*)slice->object, slice->begin, slice->end);
+			}
+			return;
+		}
+		
+		auto object = (Object*)item;
+		switch (object->type) {
+		case objectTypeString: {
+			auto str = (String*)object;
+			markVal(marker, Val::newString(str->left));
+			markVal(marker, Val::newString(str->right));
+			break;
+		}
+		case objectTypeArray: {
+			auto array = (Array*)object;
+			if (array->nElems > sliceLen) {
+				pushSlices(marker, array, array->nElems);
+			} else {
+				scanVals(marker, array->nElems, array->elems);
+			}
+			break;
+		}
+		case objectTypeStruct: {
+			auto s = (Struct*)object;
+			if (s->nSlots > sliceLen) {
+				pushSlices(marker, s, s->nSlots);
+			} else {
+				scanSlots(marker, s, 0, s->nSlots);
+			}
+			break;
+		}
+		case objectTypeFunc: {
+			auto func = (Func*)object;
+			scanVals(marker, func->nConsts, func->consts);
+			break;
+		}
+		case objectTypeThread: {
+			scanThread(marker, heap, (Thread*)object);
+			break;
+		}
+		case objectTypeChannel: {
+			break;
+		}
+		}
+	}
+	
+	static uintptr_t steal(MarkJob *job, Marker *marker) {
+		// Start with the next marker along, so thieves
+		// spread out over their victims
+		auto idx = size_t(marker - job->markers);
+		for (auto i = size_t(1); i < job->nMarkers; i++) {
+			auto victim = &job->markers[(idx + i) % job->nMarkers];
+			if (victim->deque.looksEmpty()) {
+				continue;
+			}
+			
+			// Counted before stealing, so the item is never
+			// out of every marker's hands
+			job->nActive.fetch_add(1);
+			auto item = victim->deque.steal();
+			if (item) {
+				return item;
+			}
+			job->nActive.fetch_sub(1);
+		}
+		return 0;
+	}
+	
+	// Scan objects until no marker has any left. The marker must be
+	// counted as active on entry.
+	static void runMarker(MarkJob *job, Marker *marker) {
+		for (;;) {
+			for (auto item = marker->deque.take(); item; item = marker->deque.take()) {
+				scan(marker, job->heap, item);
+			}
+			
+			job->nActive.fetch_sub(1);
+			
+			auto item = uintptr_t(0);
+			while (!item) {
+				if (job->nActive.load() == 0) {
+					return;
+				}
+				
+				item = steal(job, marker);
+				if (!item) {
+					std::this_thread::yield();
+				}
+			}
+			scan(marker, job->heap, item);
+		}
+	}
+	
+	// Hold on to the shared groups the markers reached, then let go of
+	// those held since the last collection, which may have been the only
+	// references to some of them. Copies shared of objects now found
+	// unreachable will never be shared again, so are let go of too. The
+	// groups still held, either way, are counted against the heap.
+	static void holdReachedGroups(Heap *heap, MarkJob *job) {
+		DArray<SharedGroup*> reached;
+		reached.init(16);
+		for (auto i = size_t(0); i < job->nMarkers; i++) {
+			auto groups = &job->markers[i].sharedGroups;
+			memcpy(reached.pushUninit(groups->len), groups->buf, sizeof(SharedGroup*) * groups->len);
+			groups->len = 0;
+		}
+		std::sort(reached.buf, reached.buf + reached.len);
+		reached.len = size_t(std::unique(reached.buf, reached.buf + reached.len) - reached.buf);
+		
+		for (auto i = size_t(0); i < reached.len; i++) {
+			reached.buf[i]->acquire();
+		}
+		for (auto i = size_t(0); i < heap->sharedGroups.len; i++) {
+			heap->sharedGroups.buf[i]->release();
+		}
+		heap->sharedGroups.deinit();
+		heap->sharedGroups = reached;
+		
+		// Copies of objects about to be freed are no use any more
+		auto copies = &heap->sharedCopies;
+		for (auto it = copies->begin(); it != copies->end();) {
+			auto original = it->first;
+			if (original->isMarked.load(std::memory_order_relaxed)) {
+				it++;
+			} else {
+				it->second->group->release();
+				it = copies->erase(it);
+			}
+		}
+		
+		DArray<SharedGroup*> copyGroups;
+		copyGroups.init(16);
+		for (auto &[original, copy]: *copies) {
+			copyGroups.push(copy->group);
+		}
+		std::sort(copyGroups.buf, copyGroups.buf + copyGroups.len);
+		copyGroups.len = size_t(std::unique(copyGroups.buf, copyGroups.buf + copyGroups.len) - copyGroups.buf);
+		
+		heap->sharedBytes = 0;
+		for (auto i = size_t(0); i < reached.len; i++) {
+			heap->sharedBytes += reached.buf[i]->nBytes;
+		}
+		for (auto i = size_t(0); i < copyGroups.len; i++) {
+			auto group = copyGroups.buf[i];
+			if (!std::binary_search(reached.buf, reached.buf + reached.len, group)) {
+				heap->sharedBytes += group->nBytes;
+			}
+		}
+		copyGroups.deinit();
+	}
+	
+	void Collector::mark(Heap *heap) {
+		MarkJob job;
+		job.heap = heap;
+		
+		// Share the work out if the heap is large enough for that to pay
+		// off, and no other heap is being marked with help already
+		Marker ownMarker;
+		std::unique_lock<std::mutex> sharedLock(sharedMarkersMutex, std::defer_lock);
+		auto isShared = nMarkers > 1 &&
+			heap->nObjects >= minSharedMarkObjects &&
+			sharedLock.try_lock();
+		if (isShared) {
+			job.nMarkers = nMarkers;
+			job.markers = markers;
+		} else {
+			ownMarker.deque.init();
+			ownMarker.sliceBufs.init(4);
+			ownMarker.sharedGroups.init(16);
+			job.nMarkers = 1;
+			job.markers = &ownMarker;
+		}
+		for (auto i = size_t(0); i < job.nMarkers; i++) {
+			job.markers[i].nMarked = 0;
+			job.markers[i].nMarkedBytes = 0;
+		}
+		
+		auto marker = &job.markers[0];
+		job.nActive.store(1);
+		
+		// A task's thread is its handle in the spawner's heap, so
+		// only what it holds is marked
+		auto rootThread = heap->rootThread;
+		if (rootThread->task) {
+			scanThread(marker, heap, rootThread);
+		} else {
+			markVal(marker, Val::newThread(rootThread));
+		}
+		
+		if (isShared) {
+			std::lock_guard<std::mutex> lock(mutex);
+			markJob = &job;
+			markJobId++;
+			helperCond.notify_all();
+		}
+		
+		runMarker(&job, marker);
+		
+		if (isShared) {
+			// Helpers may still be on their way out, or joining late
+			std::unique_lock<std::mutex> lock(mutex);
+			markJob = nullptr;
+			markDoneCond.wait(lock, [&]() {
+				return nHelpersMarking == 0;
+			});
+		}
+		
+		auto nMarkedTotal = size_t(0);
+		heap->liveBytes = 0;
+		for (auto i = size_t(0); i < job.nMarkers; i++) {
+			auto m = &job.markers[i];
+			nMarkedTotal += m->nMarked;
+			heap->liveBytes += m->nMarkedBytes;
+			for (auto j = size_t(0); j < m->sliceBufs.len; j++) {
+				delete[] m->sliceBufs.buf[j];
+			}
+			m->sliceBufs.len = 0;
+		}
+		holdReachedGroups(heap, &job);
+		
+		if (!isShared) {
+			ownMarker.sharedGroups.deinit();
+			ownMarker.sliceBufs.deinit();
+			ownMarker.deque.deinit();
+		} else {
+			nParallelMarks.fetch_add(1, std::memory_order_relaxed);
+		}
+		nMarked.fetch_add(nMarkedTotal, std::memory_order_relaxed);
+		
+		// Everything left to sweep and not marked is garbage
+		heap->sweepObjects = heap->objects;
+		heap->objects = nullptr;
+		heap->nObjects = nMarkedTotal;
+	}
+	
+	void Collector::sweep(Heap *heap) {
+		auto startTime = std::chrono::steady_clock::now();
+		
+		Object *kept = nullptr, *lastKept = nullptr;
+		auto nFreedHere = size_t(0), nFreedBytes = size_t(0);
+		for (auto object = heap->sweepObjects; object;) {
+			auto next = object->next;
+			
+			// Marked objects may be being written to by the script, so
+			// only the mark bit and link are touched. Unmarked objects
+			// are unreachable, unless a task's thread.
+			auto isKept = object->isMarked.load(std::memory_order_relaxed);
+			if (isKept) {
+				object->isMarked.store(false, std::memory_order_relaxed);
+			} else if (object->type == objectTypeThread && ((Thread*)object)->task) {
+				// Task not joined yet, which still needs its thread
+				isKept = true;
+			} else {
+				nFreedBytes += getObjectSize(object);
+				destroyObject(object);
+				nFreedHere++;
+			}
+			
+			if (isKept) {
+				object->next = kept;
+				kept = object;
+				if (!lastKept) {
+					lastKept = object;
+				}
+			}
+			object = next;
+		}
+		
+		heap->sweepObjects = nullptr;
+		heap->keptObjects = kept;
+		heap->lastKeptObject = lastKept;
+		heap->sweptBytes = nFreedBytes;
+		
+		nFreed.fetch_add(nFreedHere, std::memory_order_relaxed);
+		sweepNs.fetch_add(nsSince(startTime), std::memory_order_relaxed);
+	}
+	
+	void Collector::collect(Heap *heap) {
+		auto startTime = std::chrono::steady_clock::now();
+		
+		if (nMarkers > 1) {
+			std::call_once(startFlag, [this]() {
+				start();
+			});
+		}
+		
+		finishSweep(heap);
+		
+		auto markStartTime = std::chrono::steady_clock::now();
+		mark(heap);
+		markNs.fetch_add(nsSince(markStartTime), std::memory_order_relaxed);
+		
+		auto fragmentation = heap->getFragmentation();
+		auto prevMaxFragmentation = maxFragmentation.load(std::memory_order_relaxed);
+		while (fragmentation > prevMaxFragmentation && !maxFragmentation.compare_exchange_weak(
+			prevMaxFragmentation, fragmentation, std::memory_order_relaxed
+		)) { }
+		
+		// Native functions may be holding pointers to objects,
+		// so nothing can be moved while any are running
+		if (isCompacting && fragmentation >= compactFragmentation && heap->nNativeCalls == 0) {
+			auto compactStartTime = std::chrono::steady_clock::now();
+			size_t nMovedHere, nFreedHere;
+			compactHeap(heap, &nMovedHere, &nFreedHere);
+			heap->peakBytes = heap->liveBytes;
+			
+			nCompactions.fetch_add(1, std::memory_order_relaxed);
+			nMoved.fetch_add(nMovedHere, std::memory_order_relaxed);
+			nFreed.fetch_add(nFreedHere, std::memory_order_relaxed);
+			compactNs.fetch_add(nsSince(compactStartTime), std::memory_order_relaxed);
+		} else if (isStarted) {
+			std::lock_guard<std::mutex> lock(mutex);
+			heap->isSweepPending = true;
+			sweepQueue.push(heap);
+			helperCond.notify_one();
+		} else {
+			sweep(heap);
+			finishSweep(heap);
+		}
+		
+		auto pauseNs = nsSince(startTime);
+		auto prevMaxPauseNs = maxPauseNs.load(std::memory_order_relaxed);
+		while (pauseNs > prevMaxPauseNs && !maxPauseNs.compare_exchange_weak(
+			prevMaxPauseNs, pauseNs, std::memory_order_relaxed
+		)) { }
+		nCollections.fetch_add(1, std::memory_order_relaxed);
+	}
+	
+	void Collector::finishSweep(Heap *heap) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			
+			// Sweep here rather than wait if no helper
+			// has started on it yet
+			auto isQueued = false;
+			for (auto i = size_t(0); i < sweepQueue.len; i++) {
+				if (sweepQueue.buf[i] == heap) {
+					memmove(sweepQueue.buf + i, sweepQueue.buf + i + 1, sizeof(Heap*) * (sweepQueue.len - i - 1));
+					sweepQueue.len--;
+					isQueued = true;
+					break;
+				}
+			}
+			
+			if (isQueued) {
+				lock.unlock();
+				sweep(heap);
+				lock.lock();
+				heap->isSweepPending = false;
+			} else {
+				sweptCond.wait(lock, [&]() {
+					return !heap->isSweepPending;
+				});
+			}
+		}
+		
+		if (heap->keptObjects) {
+			heap->lastKeptObject->next = heap->objects;
+			heap->objects = heap->keptObjects;
+			heap->keptObjects = nullptr;
+			heap->lastKeptObject = nullptr;
+		}
+		
+		auto heldBytes = heap->liveBytes + heap->sweptBytes;
+		if (heldBytes > heap->peakBytes) {
+			heap->peakBytes = heldBytes;
+		}
+	}
+	
+	void Collector::printStats(FILE *stream) {
+		auto ms = [](std::atomic<int64_t> const &ns) {
+			return double(ns.load(std::memory_order_relaxed)) * 1e-6;
+		};
+		
+		fprintf(stream, "collections  shared  marked      freed       mark ms   sweep ms  max pause ms\n");
+		fprintf(stream, "%-12zu %-7zu %-11zu %-11zu %-9.1f %-9.1f %.2f\n",
+			nCollections.load(std::memory_order_relaxed),
+			nParallelMarks.load(std::memory_order_relaxed),
+			nMarked.load(std::memory_order_relaxed),
+			nFreed.load(std::memory_order_relaxed),
+			ms(markNs), ms(sweepNs), ms(maxPauseNs)
+		);
+		fprintf(stream, "compactions  moved       compact ms  max fragmentation\n");
+		fprintf(stream, "%-12zu %-11zu %-11.1f %.1f%%\n",
+			nCompactions.load(std::memory_order_relaxed),
+			nMoved.load(std::memory_order_relaxed),
+			ms(compactNs),
+			maxFragmentation.load(std::memory_order_relaxed) * 100.0
+		);
+	}
+	
+	void Collector::helperMain(size_t idx) {
+		auto seenMarkJobId = size_t(0);
+		
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			if (markJob && markJobId != seenMarkJobId) {
+				seenMarkJobId = markJobId;
+				auto job = markJob;
+				nHelpersMarking++;
+				lock.unlock();
+				
+				job->nActive.fetch_add(1);
+				runMarker(job, &job->markers[idx]);
+				
+				lock.lock();
+				nHelpersMarking--;
+				if (nHelpersMarking == 0) {
+					markDoneCond.notify_all();
+				}
+				continue;
+			}
+			
+			if (sweepQueue.len > 0) {
+				auto heap = sweepQueue.buf[0];
+				memmove(sweepQueue.buf, sweepQueue.buf + 1, sizeof(Heap*) * (sweepQueue.len - 1));
+				sweepQueue.len--;
+				lock.unlock();
+				
+				sweep(heap);
+				
+				lock.lock();
+				heap->isSweepPending = false;
+				sweptCond.notify_all();
+				continue;
+			}
+			
+			if (isStopping) {
+				break;
+			}
+			helperCond.wait(lock);
+		}
+	}
+	
+	void Collector::start() {
+		helpers = new std::thread[nMarkers - 1];
+		for (auto i = size_t(1); i < nMarkers; i++) {
+			helpers[i - 1] = std::thread([this, i]() {
+				helperMain(i);
+			});
+		}
+		isStarted = true;
+	}
+	
+	void Collector::init(size_t nMarkers, bool isCompacting) {
+		assert(nMarkers > 0);
+		this->nMarkers = nMarkers;
+		this->isCompacting = isCompacting;
+		
+		isStarted = false;
+		helpers = nullptr;
+		
+		markers = new Marker[nMarkers];
+		for (auto i = size_t(0); i < nMarkers; i++) {
+			markers[i].deque.init();
+			markers[i].sliceBufs.init(4);
+			markers[i].sharedGroups.init(16);
+			markers[i].nMarked = 0;
+			markers[i].nMarkedBytes = 0;
+		}
+		
+		markJob = nullptr;
+		markJobId = 0;
+		nHelpersMarking = 0;
+		sweepQueue.init(16);
+		isStopping = false;
+		
+		nCollections.store(0, std::memory_order_relaxed);
+		nParallelMarks.store(0, std::memory_order_relaxed);
+		nMarked.store(0, std::memory_order_relaxed);
+		nFreed.store(0, std::memory_order_relaxed);
+		markNs.store(0, std::memory_order_relaxed);
+		sweepNs.store(0, std::memory_order_relaxed);
+		maxPauseNs.store(0, std::memory_order_relaxed);
+		nCompactions.store(0, std::memory_order_relaxed);
+		nMoved.store(0, std::memory_order_relaxed);
+		compactNs.store(0, std::memory_order_relaxed);
+		maxFragmentation.store(0.0, std::memory_order_relaxed);
+	}
+	
+	void Collector::deinit() {
+		// Let the helpers finish any sweeps and exit
+		if (isStarted) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				isStopping = true;
+			}
+			helperCond.notify_all();
+			
+			for (auto i = size_t(0); i < nMarkers - 1; i++) {
+				helpers[i].join();
+			}
+			delete[] helpers;
+		}
+		
+		for (auto i = size_t(0); i < nMarkers; i++) {
+			markers[i].sharedGroups.deinit();
+			markers[i].sliceBufs.deinit();
+			markers[i].deque.deinit();
+		}
+		delete[] markers;
+		sweepQueue.deinit();
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "darray.h"
+#include "deque.h"
+#include "heap.h"
+
+namespace SL {
+	struct Collector;
+	struct MarkJob;
+	
+	// Part of a large array or struct still to be scanned, so that
+	// scanning one can be shared between markers
+	struct MarkSlice {
+		Object *object;
+		size_t begin, end;
+	};
+	
+	// Marks objects on behalf of one thread. Objects marked but not yet
+	// scanned go on the marker's deque, where other markers that have
+	// run out can steal them. Items are Object pointers, or MarkSlice
+	// pointers with the low bit set.
+	struct Marker {
+		WorkDeque<uintptr_t> deque;
+		
+		// Slices made while marking, freed once it's over
+		DArray<MarkSlice*> sliceBufs;
+		
+		// Groups of the shared objects reached, for the heap to hold
+		// on to. The same group is never listed twice in a row.
+		DArray<SharedGroup*> sharedGroups;
+		
+		size_t nMarked, nMarkedBytes;
+	};
+	
+	// Frees objects no longer reachable from a heap's root thread, by
+	// marking everything reachable and then sweeping the rest.
+	//
+	// Heaps are collected by their own thread, while the script waits.
+	// Marking large heaps is shared with a pool of helper threads, each
+	// marking from a deque of its own and stealing from the others once
+	// it runs out. Sweeping is then left to the helpers, so it runs at
+	// the same time as the script, and only has to be finished before
+	// the heap is next collected.
+	//
+	// A compacting collector instead moves what's reachable into
+	// regions, when too little of the memory a heap has held is still
+	// in use, so that the memory freed is left in large blocks that
+	// can go back to the system.
+	struct Collector {
+		// Number of threads marking a heap at once,
+		// including the one collecting it
+		size_t nMarkers;
+		
+		bool isCompacting;
+		
+		// Mark and start sweeping a heap, from the heap's own thread
+		void collect(Heap *heap);
+		// Wait for a heap's sweep to finish, if it hasn't, and
+		// put its remaining objects back in its list
+		void finishSweep(Heap *heap);
+		
+		// Print the number of collections, objects marked and freed,
+		// and time spent marking and sweeping, then the number of
+		// compactions, objects moved, time spent compacting, and most
+		// fragmented any heap was found to be
+		void printStats(FILE *stream);
+		
+		void init(size_t nMarkers, bool isCompacting);
+		void deinit();
+		
+	private:
+		std::once_flag startFlag;
+		bool isStarted;
+		std::thread *helpers;
+		
+		// Markers shared between the collecting thread (markers[0])
+		// and the helpers. Only one heap at a time can have help,
+		// others are marked by their own thread alone.
+		Marker *markers;
+		std::mutex sharedMarkersMutex;
+		
+		// Guards the state below, which helpers wait on
+		std::mutex mutex;
+		std::condition_variable helperCond, markDoneCond, sweptCond;
+		// Heap being marked with help, if any. Each job has a new id,
+		// so helpers join each once.
+		MarkJob *markJob;
+		size_t markJobId;
+		size_t nHelpersMarking;
+		DArray<Heap*> sweepQueue;
+		bool isStopping;
+		
+		// Statistics, totalled over all heaps
+		std::atomic<size_t> nCollections, nParallelMarks;
+		std::atomic<size_t> nMarked, nFreed;
+		std::atomic<int64_t> markNs, sweepNs, maxPauseNs;
+		std::atomic<size_t> nCompactions, nMoved;
+		std::atomic<int64_t> compactNs;
+		std::atomic<double> maxFragmentation;
+		
+		void mark(Heap *heap);
+		void sweep(Heap *heap);
+		
+		void start();
+		void helperMain(size_t idx);
+		
+	};
+}
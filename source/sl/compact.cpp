@@ -0,0 +1,334 @@
+#include "compact.h"
+
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "array.h"
+#include "darray.h"
+#include "struct.h"
+#include "thread.h"
+#include "val.h"
+
+namespace SL {
+	// Objects larger than this (with their buffers) are left in
+	// allocations of their own, which malloc keeps apart from
+	// small ones anyway
+	static constexpr size_t maxMovedSize = Region::size / 4;
+	
+	struct Compactor {
+		Heap *heap;
+		
+		// New regions, the one being filled first
+		Region *regions;
+		
+		// Old copies allocated individually, which can only be freed
+		// once nothing is left pointing to them
+		DArray<Object*> movedObjects;
+		
+		void *alloc(size_t size) {
+			size = (size + alignof(Val) - 1) & ~(alignof(Val) - 1);
+			if (!regions || Region::size - regions->used < size) {
+				auto region = Region::create();
+				region->next = regions;
+				regions = region;
+			}
+			
+			auto r = (char*)regions + regions->used;
+			regions->used += size;
+			return r;
+		}
+		
+		// Bytes the object takes once moved, or 0 if it isn't moved
+		static size_t getMovedSize(Object *object) {
+			switch (object->type) {
+			case objectTypeString: {
+				auto str = (String*)object;
+				return sizeof(String) + (str->isFlat()? str->nChars + 1 : 0);
+			}
+			case objectTypeArray: {
+				return sizeof(Array) + sizeof(Val) * ((Array*)object)->nElems;
+			}
+			case objectTypeStruct: {
+				return sizeof(Struct) + Struct::getSlotsSize(((Struct*)object)->nSlots);
+			}
+			default: {
+				return 0;
+			}
+			}
+		}
+		
+		// Copy an object into the regions, with its buffers inline
+		// after it, and free the buffers it had
+		Object *move(Object *object, size_t size) {
+			auto r = (Object*)alloc(size);
+			
+			switch (object->type) {
+			case objectTypeString: {
+				auto str = (String*)object;
+				auto copy = (String*)r;
+				memcpy((void*)copy, (void*)str, sizeof(String));
+				if (str->isFlat()) {
+					copy->chars = (char*)(copy + 1);
+					memcpy(copy->chars, str->chars, str->nChars + 1);
+					if (str->chars != (char*)(str + 1)) {
+						delete[] str->chars;
+					}
+				}
+				break;
+			}
+			case objectTypeArray: {
+				auto array = (Array*)object;
+				auto copy = (Array*)r;
+				memcpy((void*)copy, (void*)array, sizeof(Array));
+				copy->bufLen = array->nElems;
+				copy->elems = (Val*)(copy + 1);
+				memcpy(copy->elems, array->elems, sizeof(Val) * array->nElems);
+				if (!array->hasInlineElems()) {
+					delete[] array->elems;
+				}
+				break;
+			}
+			case objectTypeStruct: {
+				auto s = (Struct*)object;
+				auto copy = (Struct*)r;
+				memcpy((void*)copy, (void*)s, sizeof(Struct));
+				copy->setSlotsBuf((char*)(copy + 1));
+				memcpy(copy->keys, s->keys, Struct::getSlotsSize(s->nSlots));
+				if (!s->hasInlineSlots()) {
+					delete[] (char*)s->keys;
+				}
+				break;
+			}
+			default: {
+				assert(!"object can't be moved");
+			}
+			}
+			
+			r->isMarked.store(false, std::memory_order_relaxed);
+			r->isInRegion = true;
+			r->isForwarded = false;
+			
+			// Leave the way to the copy behind
+			if (!object->isInRegion) {
+				movedObjects.push(object);
+			}
+			object->isForwarded = true;
+			object->next = r;
+			
+			return r;
+		}
+		
+		// Move an object too large for the regions out of the old region
+		// it was compacted into, which is about to be freed, into an
+		// allocation of its own. It grew past maxMovedSize since, so
+		// its buffers were reallocated, and stay where they are.
+		Object *evacuate(Object *object) {
+			Object *r;
+			switch (object->type) {
+			case objectTypeString: {
+				// Characters stay inline until flattened, in which case
+				// the string was a concatenation when moved
+				auto str = (String*)object;
+				auto isInline = str->chars == (char*)(str + 1);
+				auto size = sizeof(String) + (isInline? str->nChars + 1 : 0);
+				r = (Object*)::operator new(size);
+				memcpy((void*)r, (void*)str, size);
+				if (isInline) {
+					((String*)r)->chars = (char*)((String*)r + 1);
+				}
+				break;
+			}
+			case objectTypeArray: {
+				auto array = (Array*)object;
+				assert(!array->hasInlineElems());
+				r = (Object*)::operator new(sizeof(Array));
+				memcpy((void*)r, (void*)array, sizeof(Array));
+				break;
+			}
+			case objectTypeStruct: {
+				auto s = (Struct*)object;
+				assert(!s->hasInlineSlots());
+				r = (Object*)::operator new(sizeof(Struct));
+				memcpy((void*)r, (void*)s, sizeof(Struct));
+				break;
+			}
+			default: {
+				assert(!"object can't be in a region");
+				return object;
+			}
+			}
+			
+			r->isMarked.store(false, std::memory_order_relaxed);
+			r->isInRegion = false;
+			r->isForwarded = false;
+			
+			object->isForwarded = true;
+			object->next = r;
+			
+			return r;
+		}
+		
+		static Val forward(Val val) {
+			if (val.isString() || val.isArray() || val.isStruct()) {
+				auto object = (Object*)val.ptrVal;
+				if (object->isForwarded) {
+					val.ptrVal = object->next;
+				}
+			}
+			return val;
+		}
+		
+		static String *forwardString(String *str) {
+			return str? forward(Val::newString(str)).stringVal : nullptr;
+		}
+		
+		static void forwardVals(size_t nVals, Val *vals) {
+			for (auto i = size_t(0); i < nVals; i++) {
+				vals[i] = forward(vals[i]);
+			}
+		}
+		
+		void fixThread(Thread *thread) {
+			// A task's thread is its handle in the spawner's heap, but
+			// what it holds belongs to the task's heap
+			if (thread->heap != heap) {
+				return;
+			}
+			
+			thread->global = forward(thread->global);
+			forwardVals(thread->stack.len, thread->stack.buf);
+			for (auto i = size_t(0); i < thread->callStack.len; i++) {
+				auto call = &thread->callStack.buf[i];
+				call->inst = forward(call->inst);
+			}
+			
+			thread->entryInst = forward(thread->entryInst);
+			if (thread->entryArgs) {
+				thread->entryArgs = forward(Val::newArray(thread->entryArgs)).arrayVal;
+			}
+		}
+		
+		// Point an object's references at the copies of
+		// any objects that have moved
+		void fix(Object *object) {
+			switch (object->type) {
+			case objectTypeString: {
+				auto str = (String*)object;
+				str->left = forwardString(str->left);
+				str->right = forwardString(str->right);
+				break;
+			}
+			case objectTypeArray: {
+				auto array = (Array*)object;
+				forwardVals(array->nElems, array->elems);
+				break;
+			}
+			case objectTypeStruct: {
+				// Keys keep their hashes, so stay in the same slots
+				auto s = (Struct*)object;
+				for (auto i = size_t(0); i < s->nSlots; i++) {
+					if (s->slotIsOccupied(i)) {
+						s->keys[i] = forwardString(s->keys[i]);
+						s->vals[i] = forward(s->vals[i]);
+					}
+				}
+				break;
+			}
+			case objectTypeThread: {
+				fixThread((Thread*)object);
+				break;
+			}
+			default: {
+				// Funcs are frozen, so hold nothing that moves
+				break;
+			}
+			}
+		}
+	};
+	
+	void compactHeap(Heap *heap, size_t *oNMoved, size_t *oNFreed) {
+		assert(heap->objects == nullptr);
+		
+		auto compactor = Compactor{.heap = heap, .regions = nullptr};
+		compactor.movedObjects.init(64);
+		
+		// Move or keep what's marked, and free the rest as a sweep
+		// would
+		Object *kept = nullptr;
+		auto nMoved = size_t(0), nFreed = size_t(0);
+		for (auto object = heap->sweepObjects; object;) {
+			auto next = object->next;
+			
+			auto isKept = object->isMarked.load(std::memory_order_relaxed);
+			if (isKept) {
+				object->isMarked.store(false, std::memory_order_relaxed);
+				auto size = Compactor::getMovedSize(object);
+				if (size > 0 && size <= maxMovedSize) {
+					object = compactor.move(object, size);
+					nMoved++;
+				} else if (object->isInRegion) {
+					// Has outgrown the regions since it was last
+					// moved, but its old region is about to go
+					object = compactor.evacuate(object);
+					nMoved++;
+				}
+			} else if (object->type == objectTypeThread && ((Thread*)object)->task) {
+				// Task not joined yet, which still needs its thread
+				isKept = true;
+			} else {
+				destroyObject(object);
+				nFreed++;
+			}
+			
+			if (isKept) {
+				object->next = kept;
+				kept = object;
+			}
+			object = next;
+		}
+		
+		// Everything reachable is now in the list, except a task's
+		// thread, which is its spawner's
+		for (auto object = kept; object; object = object->next) {
+			compactor.fix(object);
+		}
+		compactor.fixThread(heap->rootThread);
+		
+		// Copies shared of objects are found by the original,
+		// which may have moved
+		std::unordered_map<Object*, Object*> sharedCopies;
+		for (auto &[original, copy]: heap->sharedCopies) {
+			sharedCopies[original->isForwarded? original->next : original] = copy;
+		}
+		heap->sharedCopies.swap(sharedCopies);
+		
+		for (auto i = size_t(0); i < compactor.movedObjects.len; i++) {
+			::operator delete(compactor.movedObjects.buf[i]);
+		}
+		compactor.movedObjects.deinit();
+		
+		for (auto region = heap->regions; region;) {
+			auto next = region->next;
+			Region::destroy(region);
+			region = next;
+		}
+		heap->regions = compactor.regions;
+		
+		heap->objects = kept;
+		heap->sweepObjects = nullptr;
+		
+		// glibc only hands memory back to the system by itself from
+		// the top of the heap, not from the gaps left behind
+#ifdef __GLIBC__
+		malloc_trim(0);
+#endif
+		
+		*oNMoved = nMoved;
+		*oNFreed = nFreed;
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+#include "heap.h"
+
+namespace SL {
+	// Move a marked heap's reachable strings, arrays, and structs into
+	// new regions, each followed by its buffers, and point everything
+	// reachable at the copies. Memory held by the old copies and by
+	// unreachable objects is freed, along with the old regions.
+	//
+	// Funcs and threads stay where they are, as do objects too large
+	// to be worth moving, other than those that have grown that large
+	// since being compacted, whose headers are moved out of their old
+	// regions on their own. Nothing outside the heap's
+	// objects and root thread may be pointing into it, so no native
+	// function can be running.
+	//
+	// Takes the place of a sweep: the heap's objects must be in
+	// sweepObjects, and the marks are cleared.
+	void compactHeap(Heap *heap, size_t *oNMoved, size_t *oNFreed);
+}
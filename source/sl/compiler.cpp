@@ -6,6 +6,12 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "freeze.h"
+#include "funcinfo.h"
+#include "globals.h"
+#include "number.h"
+#include "struct.h"
+
 static void printError(char const *file, size_t line, char const *msgFmt, ...) {
 	va_list args1, args2;
 	va_start(args1, msgFmt);
@@ -130,6 +136,10 @@ namespace SL {
 			return Token{tokenKindKwContinue, line};
 		} else if (isKw("return")) {
 			return Token{tokenKindKwReturn, line};
+		} else if (isKw("for")) {
+			return Token{tokenKindKwFor, line};
+		} else if (isKw("in")) {
+			return Token{tokenKindKwIn, line};
 		}
 		return Token{
 			.kind = tokenKindName,
@@ -160,7 +170,7 @@ namespace SL {
 			throw 0;
 		}
 		
-		auto val = strtod(chars, nullptr);
+		auto val = parseNumber(size_t(it - chars), chars);
 		
 		eolIsWs = false;
 		return Token{
@@ -350,10 +360,54 @@ namespace SL {
 				return i;
 			}
 		}
+		
+		// Freeze constants now (which hashes strings), so compiled
+		// functions are never written to and can be shared between
+		// threads and heaps
+		freezeVal(val);
+		
 		consts.push(val);
 		return consts.len - 1;
 	}
 	
+	Func *Compiler::createFunc(size_t nameNChars, char const *nameChars) {
+		auto r = Func::create(heap);
+		r->nConsts = consts.len;
+		r->consts = consts.buf;
+		r->nOps = ops.len;
+		r->ops = ops.buf;
+		r->nParams = nParams;
+		r->nLocals = nLocals;
+		
+		r->name = String::create(heap, nameNChars, nameChars);
+		freezeVal(Val::newString(r->name));
+		r->file = fileString;
+		r->nLineSpans = lineSpans.len;
+		r->lineSpans = lineSpans.buf;
+		r->info = addFuncInfo(r);
+		
+		// Immutable from here on, like its consts
+		r->isFrozen = true;
+		
+		return r;
+	}
+	
+	void Compiler::markLine() {
+		auto line = uint32_t(nextToken.line + 1);
+		if (lineSpans.len > 0) {
+			auto last = &lineSpans.buf[lineSpans.len - 1];
+			if (last->line == line) {
+				return;
+			}
+			// No ops compiled from the last line after all
+			if (last->firstOp == ops.len) {
+				last->line = line;
+				return;
+			}
+		}
+		lineSpans.push(LineSpan{uint32_t(ops.len), line});
+	}
+	
 	int32_t Compiler::createLocal(size_t nameNChars, char const *nameChars) {
 		nLocals++;
 		activeVars.push(Var{
@@ -376,6 +430,24 @@ namespace SL {
 		return false;
 	}
 	
+	void Compiler::pushGetGlobal(Token nameToken) {
+		// Globals are got from their slots, other than functions called
+		// from inside other functions, which are got from the global
+		// struct, so they're called with it as their instance
+		if (!isTopLevel && nextToken.kind == '(') {
+			ops.push(Op{opcodeGetGlobal});
+			
+			auto key = String::create(heap, nameToken.strVal.nChars, nameToken.strVal.chars);
+			auto arg = getConst(Val::newString(key));
+			ops.push(Op{opcodeGetConst, int32_t(arg)});
+			
+			ops.push(Op{opcodeGetElem});
+		} else {
+			auto slot = getGlobalSlot(nameToken.strVal.nChars, nameToken.strVal.chars);
+			ops.push(Op{opcodeGetGlobalSlot, int32_t(slot)});
+		}
+	}
+	
 	void Compiler::enterScope(bool isLoop) {
 		scopes.push(Scope{
 			.firstOp = ops.len,
@@ -424,6 +496,13 @@ namespace SL {
 	}
 	
 	bool Compiler::eatExpr(size_t minPrecedence) {
+		markLine();
+		
+		// Only a function literal at the very start of
+		// the expression takes the name
+		auto name = funcName;
+		funcName = {0, nullptr};
+		
 		auto hasLhs = false;
 		if (nextToken.kind == '(') {
 			eatToken();
@@ -483,13 +562,14 @@ namespace SL {
 		} else if (nextToken.kind == '{') {
 			eatToken();
 			
-			auto nElems = size_t(0);
+			// Keys are all constant, so gather them into a template
+			// whose values are the positions of the corresponding
+			// values on the stack
+			auto keys = Struct::create(heap, 0);
 			
 			while (nextToken.kind == tokenKindString ||
 				nextToken.kind == tokenKindName
 			) {
-				nElems++;
-				
 				String *key;
 				if (nextToken.kind == tokenKindString) {
 					key = createStringFromToken(nextToken);
@@ -499,13 +579,19 @@ namespace SL {
 				
 				eatToken();
 				
-				auto arg = getConst(Val::newString(key));
-				ops.push(Op{opcodeGetConst, int32_t(arg)});
-				
 				expectToken(TokenKind('='), "'='");
 				
+				funcName = {key->nChars, key->getChars()};
 				expectExpr();
 				
+				// The first value given for a key is used, later ones
+				// are still evaluated but discarded
+				if (keys->find(key) == SIZE_MAX) {
+					keys->set(key, Val::newNumber(double(keys->nKeys)));
+				} else {
+					ops.push(Op{opcodeEat});
+				}
+				
 				if (!eatSepToken()) {
 					break;
 				}
@@ -513,7 +599,16 @@ namespace SL {
 			
 			expectToken(TokenKind('}'), "'}'");
 			
-			ops.push(Op{opcodeMakeStruct, int32_t(nElems)});
+			// Copy into a template sized exactly for its keys
+			auto tmpl = Struct::create(heap, keys->nKeys);
+			for (auto i = size_t(0); i < keys->nSlots; i++) {
+				if (keys->slotIsOccupied(i)) {
+					tmpl->set(keys->keys[i], keys->vals[i]);
+				}
+			}
+			
+			auto arg = getConst(Val::newStruct(tmpl));
+			ops.push(Op{opcodeMakeStruct, int32_t(arg)});
 			
 			hasLhs = true;
 		} else if (nextToken.kind == tokenKindKwFunc) {
@@ -521,18 +616,24 @@ namespace SL {
 			
 			auto prevConsts = consts;
 			auto prevOps = ops;
+			auto prevLineSpans = lineSpans;
 			auto prevNParams = nParams;
 			auto prevNVars = nLocals;
+			auto prevIsTopLevel = isTopLevel;
 			auto prevActiveLocals = activeVars;
 			auto prevScopes = scopes;
 			
 			consts.init(8);
 			ops.init(32);
+			lineSpans.init(8);
 			nParams = 0;
 			nLocals = 0;
+			isTopLevel = false;
 			activeVars.init(8);
 			scopes.init(8);
 			
+			markLine();
+			
 			expectToken(TokenKind('('), "'('");
 			
 			while (nextToken.kind == tokenKindName) {
@@ -561,18 +662,17 @@ namespace SL {
 			
 			expectToken(TokenKind('}'), "");
 			
-			auto func = Func::create(heap);
-			func->nConsts = consts.len;
-			func->consts = consts.buf;
-			func->nOps = ops.len;
-			func->ops = ops.buf;
-			func->nParams = nParams;
-			func->nLocals = nLocals;
+			static char const anonymousName[] = "<anonymous>";
+			auto func = name.chars?
+				createFunc(name.nChars, name.chars) :
+				createFunc(sizeof(anonymousName) - 1, anonymousName);
 			
 			scopes = prevScopes;
 			activeVars = prevActiveLocals;
+			isTopLevel = prevIsTopLevel;
 			nLocals = prevNVars;
 			nParams = prevNParams;
+			lineSpans = prevLineSpans;
 			ops = prevOps;
 			consts = prevConsts;
 			
@@ -594,33 +694,28 @@ namespace SL {
 			hasLhs = true;
 		} else if (nextToken.kind == tokenKindName) {
 			int32_t idx;
-			if (getVar(nextToken.strVal.nChars, nextToken.strVal.chars, &idx)) {
+			auto nameToken = eatToken();
+			if (getVar(nameToken.strVal.nChars, nameToken.strVal.chars, &idx)) {
 				ops.push(Op{opcodeGetVar, idx});
+			} else if (isTopLevel) {
+				// The top level's instance is the global struct
+				pushGetGlobal(nameToken);
 			} else {
 				ops.push(Op{opcodeGetInst});
 				
-				auto key = String::create(heap, nextToken.strVal.nChars, nextToken.strVal.chars);
+				auto key = String::create(heap, nameToken.strVal.nChars, nameToken.strVal.chars);
 				auto arg = getConst(Val::newString(key));
 				ops.push(Op{opcodeGetConst, int32_t(arg)});
 				
 				ops.push(Op{opcodeGetElem});
 			}
 			
-			eatToken();
-			
 			hasLhs = true;
 		} else if (nextToken.kind == '@') {
 			eatToken();
 			
 			auto nameToken = expectToken(tokenKindName, "name");
-			
-			ops.push(Op{opcodeGetGlobal});
-			
-			auto key = String::create(heap, nameToken.strVal.nChars, nameToken.strVal.chars);
-			auto arg = getConst(Val::newString(key));
-			ops.push(Op{opcodeGetConst, int32_t(arg)});
-			
-			ops.push(Op{opcodeGetElem});
+			pushGetGlobal(nameToken);
 			
 			hasLhs = true;
 		}
@@ -657,11 +752,17 @@ namespace SL {
 				
 				auto nameToken = expectToken(tokenKindName, "name");
 				
-				auto key = String::create(heap, nameToken.strVal.nChars, nameToken.strVal.chars);
-				auto arg = getConst(Val::newString(key));
-				ops.push(Op{opcodeGetConst, int32_t(arg)});
-				
-				ops.push(Op{opcodeGetElem});
+				if (ops.buf[ops.len - 1].opcode == opcodeGetGlobal) {
+					// global.name, the same as @name
+					ops.len--;
+					pushGetGlobal(nameToken);
+				} else {
+					auto key = String::create(heap, nameToken.strVal.nChars, nameToken.strVal.chars);
+					auto arg = getConst(Val::newString(key));
+					ops.push(Op{opcodeGetConst, int32_t(arg)});
+					
+					ops.push(Op{opcodeGetElem});
+				}
 			} else {
 				auto op = nextToken.kind;
 				
@@ -760,6 +861,8 @@ namespace SL {
 	}
 	
 	bool Compiler::eatStmt() {
+		markLine();
+		
 		if (nextToken.kind == '{') {
 			enterScope();
 			
@@ -790,6 +893,7 @@ namespace SL {
 			if (nextToken.kind == '=') {
 				eatToken();
 				
+				funcName = {nameToken.strVal.nChars, nameToken.strVal.chars};
 				expectExpr();
 				
 				ops.push(Op{opcodeSetVar, idx});
@@ -846,6 +950,60 @@ namespace SL {
 			
 			exitScope();
 			
+			return true;
+		} else if (nextToken.kind == tokenKindKwFor) {
+			// Scope of the iteration state and variables
+			enterScope();
+			
+			eatToken();
+			
+			auto keyToken = expectToken(tokenKindName, "name");
+			
+			auto hasValName = false;
+			Token valToken;
+			if (nextToken.kind == ',') {
+				eatToken();
+				
+				valToken = expectToken(tokenKindName, "name");
+				hasValName = true;
+			}
+			
+			expectToken(tokenKindKwIn, "'in'");
+			
+			expectExpr();
+			
+			// The iteration state is kept in unnamed locals laid out
+			// as expected by opcodeIterInit and opcodeIterNext
+			auto base = createLocal(0, nullptr);
+			createLocal(0, nullptr);
+			createLocal(0, nullptr);
+			createLocal(keyToken.strVal.nChars, keyToken.strVal.chars);
+			if (hasValName) {
+				createLocal(valToken.strVal.nChars, valToken.strVal.chars);
+			} else {
+				createLocal(0, nullptr);
+			}
+			
+			ops.push(Op{opcodeIterInit, base});
+			
+			enterScope(true);
+			
+			auto start = int32_t(ops.len);
+			
+			ops.push(Op{opcodeIterNext, base});
+			
+			auto jmpEndOp = ops.len;
+			ops.push(Op{opcodeJmpN, -1});
+			
+			expectStmt();
+			
+			ops.push(Op{opcodeJmp, start});
+			
+			ops.buf[jmpEndOp].arg = int32_t(ops.len);
+			
+			exitScope();
+			exitScope();
+			
 			return true;
 		} else if (nextToken.kind == tokenKindKwBreak) {
 			auto inLoop = false;
@@ -895,6 +1053,15 @@ namespace SL {
 				ops.push(Op{opcodeGetConst, int32_t(arg)});
 			}
 			
+			// A call made last is in tail position, so needn't keep this
+			// call's frame. The return stays for anything jumping past it.
+			auto lastOp = &ops.buf[ops.len - 1];
+			if (lastOp->opcode == opcodeCall) {
+				lastOp->opcode = opcodeTailCall;
+			} else if (lastOp->opcode == opcodeInstCall) {
+				lastOp->opcode = opcodeTailInstCall;
+			}
+			
 			ops.push(Op{opcodeRet});
 			
 			return true;
@@ -902,6 +1069,7 @@ namespace SL {
 			if (nextToken.kind == '=') {
 				auto getOp = ops.pop();
 				if (getOp.opcode != opcodeGetVar &&
+					getOp.opcode != opcodeGetGlobalSlot &&
 					getOp.opcode != opcodeGetElem
 				) {
 					printError(file, nextToken.line, "assignment to unassignable expression");
@@ -910,10 +1078,30 @@ namespace SL {
 				
 				eatToken();
 				
+				// Name any function assigned after the variable,
+				// or the key when it's a constant string
+				if (getOp.opcode == opcodeGetVar) {
+					for (auto i = activeVars.len; i-- > 0;) {
+						if (activeVars.buf[i].idx == getOp.arg) {
+							funcName = {activeVars.buf[i].name.nChars, activeVars.buf[i].name.chars};
+							break;
+						}
+					}
+				} else if (getOp.opcode == opcodeGetGlobalSlot) {
+					auto name = getGlobalName(uint32_t(getOp.arg));
+					funcName = {name->size(), name->data()};
+				} else if (ops.len > 0 && ops.buf[ops.len - 1].opcode == opcodeGetConst) {
+					auto key = consts.buf[ops.buf[ops.len - 1].arg];
+					if (key.isString()) {
+						funcName = {key.stringVal->nChars, key.stringVal->getChars()};
+					}
+				}
 				expectExpr();
 				
 				if (getOp.opcode == opcodeGetVar) {
 					ops.push(Op{opcodeSetVar, getOp.arg});
+				} else if (getOp.opcode == opcodeGetGlobalSlot) {
+					ops.push(Op{opcodeSetGlobalSlot, getOp.arg});
 				} else if (getOp.opcode == opcodeGetElem) {
 					ops.push(Op{opcodeSetElem});
 				}
@@ -964,27 +1152,28 @@ namespace SL {
 		
 		lexer.init(file, nChars, chars);
 		nextToken = lexer.eatToken();
+		funcName = {0, nullptr};
 		
 		consts.init(8);
 		ops.init(32);
+		lineSpans.init(8);
 		nParams = 0;
 		nLocals = 0;
+		isTopLevel = true;
 		activeVars.init(8);
 		scopes.init(8);
 		breakOps.init(8);
 		
 		try {
+			fileString = String::create(heap, strlen(file), file);
+			freezeVal(Val::newString(fileString));
+			
 			eatFuncStmtList();
 			
 			expectToken(tokenKindEof, "end of file");
 			
-			auto r = Func::create(heap);
-			r->nConsts = consts.len;
-			r->consts = consts.buf;
-			r->nOps = ops.len;
-			r->ops = ops.buf;
-			r->nParams = nParams;
-			r->nLocals = nLocals;
+			static char const mainName[] = "<main>";
+			auto r = createFunc(sizeof(mainName) - 1, mainName);
 			
 			breakOps.deinit();
 			scopes.deinit();
@@ -992,15 +1181,19 @@ namespace SL {
 			lexer.deinit();
 			
 			return r;
+		} catch (HeapLimitError const &) {
+			printf("%s: heap limit of %zu bytes reached while compiling\n", file, heap->maxBytes);
 		} catch (...) {
-			breakOps.deinit();
-			scopes.deinit();
-			activeVars.deinit();
-			ops.deinit();
-			consts.deinit();
-			lexer.deinit();
-			
-			return nullptr;
 		}
+		
+		breakOps.deinit();
+		scopes.deinit();
+		activeVars.deinit();
+		lineSpans.deinit();
+		ops.deinit();
+		consts.deinit();
+		lexer.deinit();
+		
+		return nullptr;
 	}
 }
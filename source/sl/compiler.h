@@ -68,22 +68,43 @@ namespace SL {
 		Heap *heap;
 		
 		char const *file;
+		// File as a string, shared by every function compiled from it
+		String *fileString;
 		
 		Lexer lexer;
 		Token nextToken;
 		
 		DArray<Val> consts;
 		DArray<Op> ops;
+		DArray<LineSpan> lineSpans;
 		size_t nParams, nLocals;
+		// Whether the function being compiled is the file's top level,
+		// which is run with the global struct as its instance
+		bool isTopLevel;
 		DArray<Var> activeVars;
 		DArray<Scope> scopes;
 		DArray<size_t> breakOps;
 		
+		// Name to give a function literal making up the whole of the
+		// next expression, as in `f = func() {}`, or null chars if none
+		struct {
+			size_t nChars;
+			char const *chars;
+		} funcName;
+		
 		String *createStringFromToken(Token token);
 		
 		size_t getConst(Val val);
+		// Create a function from the consts and ops gathered so far
+		Func *createFunc(size_t nameNChars, char const *nameChars);
+		// Attribute the ops compiled from here on to the line of the
+		// next token
+		void markLine();
 		int32_t createLocal(size_t nameNChars, char const *nameChars);
 		bool getVar(size_t nameNChars, char const *nameChars, int32_t *oIdx);
+		// Push ops getting the global named by nameToken, the token
+		// just eaten
+		void pushGetGlobal(Token nameToken);
 		void enterScope(bool isLoop = false);
 		void exitScope();
 		
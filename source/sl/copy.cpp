@@ -0,0 +1,293 @@
+#include "copy.h"
+
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "allocstats.h"
+#include "array.h"
+#include "func.h"
+#include "struct.h"
+
+namespace SL {
+	struct Copier {
+		// Heap the copies are made in, and the one the
+		// values copied belong to
+		Heap *heap, *fromHeap;
+		
+		// Whether to move arrays and share strings
+		// rather than copy them
+		bool isMove;
+		
+		// Copies made so far, by original
+		std::unordered_map<Object*, Val> copies;
+		
+		// Heap making copies of fromHeap's objects in a new shared
+		// group, once the first is needed, and the other groups the
+		// new one holds references to
+		Heap sharedHeap;
+		bool hasSharedHeap;
+		std::unordered_set<SharedGroup*> heldGroups;
+		
+		Val copy(Val val) {
+			switch (val.type) {
+			case typeNil:
+			case typeNumber: {
+				return val;
+			}
+			case typeFunc:
+			case typeChannel: {
+				return share(val);
+			}
+			case typeThread: {
+				return Val::newNil();
+			}
+			case typeString: {
+				if (isMove) {
+					return share(val);
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+			}
+			
+			// Frozen objects are never written to, so every
+			// heap can share them
+			if (((Object*)val.ptrVal)->isFrozen) {
+				return share(val);
+			}
+			
+			auto it = copies.find((Object*)val.ptrVal);
+			if (it != copies.end()) {
+				return it->second;
+			}
+			
+			if (val.isArray() && isMove) {
+				// Hand the elements over to a new array, leaving
+				// the original empty. Elements stored inline go
+				// with the region, so are copied instead.
+				auto array = val.arrayVal;
+				auto r = (Array*)heap->createObject(sizeof(Array), objectTypeArray);
+				r->bufLen = array->bufLen;
+				r->nElems = array->nElems;
+				if (array->hasInlineElems()) {
+					r->elems = new Val[array->nElems];
+					trackBufferAlloc(objectTypeArray, sizeof(Val) * array->nElems);
+					memcpy(r->elems, array->elems, sizeof(Val) * array->nElems);
+				} else {
+					r->elems = array->elems;
+				}
+				array->bufLen = 0;
+				array->nElems = 0;
+				array->elems = nullptr;
+				
+				copies[array] = Val::newArray(r);
+				
+				// Only objects need preparing, and arrays
+				// are often all numbers
+				for (auto i = size_t(0); i < r->nElems; i++) {
+					auto elem = r->elems[i];
+					if (elem.type != typeNil && elem.type != typeNumber) {
+						r->elems[i] = copy(elem);
+					}
+				}
+				return Val::newArray(r);
+			} else if (val.isString()) {
+				auto str = val.stringVal;
+				auto r = Val::newString(String::create(heap, str->nChars, str->getChars()));
+				copies[str] = r;
+				return r;
+			} else if (val.isArray()) {
+				auto array = val.arrayVal;
+				auto r = Array::create(heap, array->nElems);
+				
+				// Register the copy before copying elements,
+				// so cycles back to the array find it
+				copies[array] = Val::newArray(r);
+				
+				for (auto i = size_t(0); i < array->nElems; i++) {
+					r->elems[i] = copy(array->elems[i]);
+				}
+				return Val::newArray(r);
+			} else {
+				auto s = val.structVal;
+				auto r = Struct::create(heap, s->nKeys);
+				copies[s] = Val::newStruct(r);
+				
+				for (auto i = size_t(0); i < s->nSlots; i++) {
+					if (s->slotIsOccupied(i)) {
+						auto key = copy(Val::newString(s->keys[i])).stringVal;
+						r->set(key, copy(s->vals[i]));
+					}
+				}
+				return Val::newStruct(r);
+			}
+		}
+		
+		// Shared object standing in for an object that can't change,
+		// copying it into the new shared group if it isn't shared yet
+		Object *getShared(Object *object) {
+			if (object->owner == objectOwnerShared) {
+				return object;
+			}
+			
+			auto it = fromHeap->sharedCopies.find(object);
+			if (it != fromHeap->sharedCopies.end()) {
+				return it->second;
+			}
+			return copyShared(object);
+		}
+		
+		// Share an object that can't change with heap, which takes a
+		// reference to its group, unless it's in transit, in which case
+		// the reference stays with the value until adopted
+		Val share(Val val) {
+			auto object = getShared((Object*)val.ptrVal);
+			object->group->acquire();
+			if (!isMove) {
+				heap->holdSharedGroup(object->group);
+			}
+			
+			val.ptrVal = object;
+			return val;
+		}
+		
+		// Like share, for a value reached from an object in the
+		// new shared group, which takes the reference
+		Val shareFromGroup(Val val) {
+			if (!val.isString() && !val.isArray() && !val.isStruct() && !val.isFunc() && !val.isChannel()) {
+				return val;
+			}
+			
+			auto object = getShared((Object*)val.ptrVal);
+			if (object->group != sharedHeap.sharedGroup && heldGroups.insert(object->group).second) {
+				object->group->acquire();
+				sharedHeap.sharedGroup->groups.push(object->group);
+			}
+			
+			val.ptrVal = object;
+			return val;
+		}
+		
+		// Copy an object into the new shared group, frozen, along with
+		// what it reaches that isn't shared yet, and record the copy
+		// in fromHeap, which holds a reference to the group for it
+		Object *copyShared(Object *object) {
+			if (!hasSharedHeap) {
+				sharedHeap.initShared();
+				hasSharedHeap = true;
+			}
+			
+			// Recorded before copying what the object reaches,
+			// so cycles back to it find the copy
+			auto record = [&](Object *copy) {
+				copy->group->acquire();
+				fromHeap->sharedCopies[object] = copy;
+			};
+			
+			Object *r;
+			switch (object->type) {
+			case objectTypeString: {
+				auto str = (String*)object;
+				str->flatten();
+				auto copy = String::create(&sharedHeap, str->nChars, str->chars);
+				copy->hash();
+				record(copy);
+				r = copy;
+				break;
+			}
+			case objectTypeArray: {
+				auto array = (Array*)object;
+				auto copy = Array::create(&sharedHeap, array->nElems);
+				record(copy);
+				for (auto i = size_t(0); i < array->nElems; i++) {
+					copy->elems[i] = shareFromGroup(array->elems[i]);
+				}
+				r = copy;
+				break;
+			}
+			case objectTypeStruct: {
+				auto s = (Struct*)object;
+				auto copy = Struct::create(&sharedHeap, s->nKeys);
+				record(copy);
+				for (auto i = size_t(0); i < s->nSlots; i++) {
+					if (s->slotIsOccupied(i)) {
+						auto key = shareFromGroup(Val::newString(s->keys[i])).stringVal;
+						copy->set(key, shareFromGroup(s->vals[i]));
+					}
+				}
+				r = copy;
+				break;
+			}
+			case objectTypeFunc: {
+				// Compiled functions are shared already,
+				// so only natives are ever copied
+				auto func = (Func*)object;
+				assert(func->native != nullptr);
+				r = Func::createNative(&sharedHeap, func->native);
+				record(r);
+				break;
+			}
+			default: {
+				assert(!"object can't be shared");
+				return object;
+			}
+			}
+			
+			r->isFrozen = true;
+			return r;
+		}
+		
+		// Let go of the new shared group, if any, which is left to
+		// the references to it made since, and count it against
+		// fromHeap, which holds it for the copies
+		void deinit() {
+			if (hasSharedHeap) {
+				fromHeap->addBytes(sharedHeap.getNBytes());
+				sharedHeap.deinit();
+			}
+		}
+	};
+	
+	Val copyVal(Heap *heap, Heap *fromHeap, Val val) {
+		Val r;
+		copyVals(heap, fromHeap, 1, &val, &r);
+		return r;
+	}
+	
+	void copyVals(Heap *heap, Heap *fromHeap, size_t nVals, Val const *vals, Val *oVals) {
+		auto copier = Copier{.heap = heap, .fromHeap = fromHeap, .isMove = false, .hasSharedHeap = false};
+		try {
+			for (auto i = size_t(0); i < nVals; i++) {
+				oVals[i] = copier.copy(vals[i]);
+			}
+		} catch (HeapLimitError const &) {
+			copier.deinit();
+			throw;
+		}
+		copier.deinit();
+	}
+	
+	Val moveVal(Heap *fromHeap, Val val) {
+		// Moved objects belong to no heap until received
+		static Heap *transitHeap = []() {
+			auto r = new Heap;
+			r->initTransit();
+			return r;
+		}();
+		
+		auto copier = Copier{.heap = transitHeap, .fromHeap = fromHeap, .isMove = true, .hasSharedHeap = false};
+		Val r;
+		try {
+			r = copier.copy(val);
+		} catch (HeapLimitError const &) {
+			copier.deinit();
+			throw;
+		}
+		copier.deinit();
+		return r;
+	}
+}
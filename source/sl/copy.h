@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+
+#include "heap.h"
+#include "val.h"
+
+namespace SL {
+	// Deep copy a value of fromHeap into heap, so that the copy shares
+	// no mutable objects with the original. Objects reachable more than
+	// once (or through cycles) are copied once. Frozen objects and
+	// functions can't change, so are shared rather than copied, as are
+	// channels. Threads can't be copied and become nil.
+	//
+	// Objects are shared through copies in shared groups, which fromHeap
+	// makes the first time each is shared, and reuses while the original
+	// is reachable. heap takes a reference to their groups.
+	Val copyVal(Heap *heap, Heap *fromHeap, Val val);
+	// Copy several values at once, so objects shared between
+	// them are also shared between their copies
+	void copyVals(Heap *heap, Heap *fromHeap, size_t nVals, Val const *vals, Val *oVals);
+	
+	// Prepare a value of fromHeap to be handed to another thread,
+	// copying as little as possible. Strings are shared, like frozen
+	// objects and functions. Arrays are moved: each one's elements are
+	// handed to a new array, leaving the original empty, so the sender
+	// loses access to them. Structs are copied, and the values in
+	// arrays and structs are prepared in the same way.
+	//
+	// New arrays and structs are in transit, belonging to no heap, until
+	// the receiving heap adopts them. Until then, each reference to a
+	// shared object, from them or the value itself, holds a reference
+	// to its group.
+	Val moveVal(Heap *fromHeap, Val val);
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 
 namespace SL {
@@ -25,6 +27,52 @@ namespace SL {
 			buf[len++] = elem;
 		}
 		
+		// Like push, but ordered so that a signal handler interrupting
+		// it on the same OS thread always finds a valid buffer, with
+		// len valid elements in
+		void pushForSignals(T elem) {
+			if (len == bufLen) {
+				assert(bufLen <= SIZE_MAX/2);
+				
+				auto newBuf = new T[bufLen * 2];
+				memcpy(newBuf, buf, sizeof(T) * len);
+				
+				auto oldBuf = buf;
+				std::atomic_signal_fence(std::memory_order_release);
+				buf = newBuf;
+				bufLen *= 2;
+				std::atomic_signal_fence(std::memory_order_release);
+				delete[] oldBuf;
+			}
+			
+			buf[len] = elem;
+			std::atomic_signal_fence(std::memory_order_release);
+			len++;
+		}
+		
+		// Add n elements, left for the caller to set, growing the
+		// buffer at most once, and return the first of them
+		T *pushUninit(size_t n) {
+			if (bufLen - len < n) {
+				auto newBufLen = bufLen;
+				do {
+					assert(newBufLen <= SIZE_MAX/2);
+					newBufLen *= 2;
+				} while (newBufLen - len < n);
+				
+				auto newBuf = new T[newBufLen];
+				memcpy(newBuf, buf, sizeof(T) * len);
+				
+				delete[] buf;
+				buf = newBuf;
+				bufLen = newBufLen;
+			}
+			
+			auto r = buf + len;
+			len += n;
+			return r;
+		}
+		
 		T pop() {
 			assert(len != 0);
 			return buf[--len];
@@ -37,8 +85,12 @@ namespace SL {
 			buf = new T[bufLen];
 		}
 		
+		// Safe to call more than once
 		void deinit() {
 			delete[] buf;
+			buf = nullptr;
+			bufLen = 0;
+			len = 0;
 		}
 	};
 }
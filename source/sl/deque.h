@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "darray.h"
+
+namespace SL {
+	// Work-stealing deque (Chase and Lev, with the memory orderings of
+	// Lê et al.). Only its owner pushes and takes items, at the bottom,
+	// while any thread can steal them from the top. Items are pointers
+	// or integers, with T{} meaning no item.
+	template <typename T>
+	struct WorkDeque {
+		struct Ring {
+			// Power of 2
+			int64_t len;
+			std::atomic<T> *items;
+		};
+		
+		std::atomic<int64_t> top, bottom;
+		std::atomic<Ring*> ring;
+		
+		// Rings outgrown, kept until deinit as
+		// thieves may still be reading them
+		DArray<Ring*> oldRings;
+		
+		void push(T item) {
+			auto b = bottom.load(std::memory_order_relaxed);
+			auto t = top.load(std::memory_order_acquire);
+			auto r = ring.load(std::memory_order_relaxed);
+			if (b - t > r->len - 1) {
+				r = grow(r, t, b);
+			}
+			
+			r->items[b & (r->len - 1)].store(item, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_release);
+		}
+		
+		// Returns T{} if empty
+		T take() {
+			// Claim the bottom item before checking whether any thieves
+			// got to it first
+			auto b = bottom.load(std::memory_order_relaxed) - 1;
+			auto r = ring.load(std::memory_order_relaxed);
+			bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto t = top.load(std::memory_order_relaxed);
+			
+			if (t > b) {
+				// Empty
+				bottom.store(b + 1, std::memory_order_relaxed);
+				return T{};
+			}
+			
+			auto item = r->items[b & (r->len - 1)].load(std::memory_order_relaxed);
+			if (t == b) {
+				// Last item, which thieves may be trying to steal too
+				if (!top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed
+				)) {
+					item = T{};
+				}
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return item;
+		}
+		
+		// Returns T{} if empty, or if another thread took the item first
+		T steal() {
+			auto t = top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto b = bottom.load(std::memory_order_acquire);
+			
+			if (t >= b) {
+				return T{};
+			}
+			
+			auto r = ring.load(std::memory_order_acquire);
+			auto item = r->items[t & (r->len - 1)].load(std::memory_order_relaxed);
+			if (!top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed
+			)) {
+				return T{};
+			}
+			return item;
+		}
+		
+		// Whether there's nothing to steal, which may
+		// no longer be true by the time it returns
+		bool looksEmpty() const {
+			return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+		}
+		
+		void init() {
+			top.store(0, std::memory_order_relaxed);
+			bottom.store(0, std::memory_order_relaxed);
+			ring.store(createRing(64), std::memory_order_relaxed);
+			oldRings.init(4);
+		}
+		
+		void deinit() {
+			for (auto i = size_t(0); i < oldRings.len; i++) {
+				destroyRing(oldRings.buf[i]);
+			}
+			oldRings.deinit();
+			destroyRing(ring.load(std::memory_order_relaxed));
+		}
+		
+	private:
+		static Ring *createRing(int64_t len) {
+			auto r = new Ring;
+			r->len = len;
+			r->items = new std::atomic<T>[size_t(len)];
+			return r;
+		}
+		
+		static void destroyRing(Ring *ring) {
+			delete[] ring->items;
+			delete ring;
+		}
+		
+		Ring *grow(Ring *oldRing, int64_t top, int64_t bottom) {
+			auto r = createRing(oldRing->len * 2);
+			for (auto i = top; i < bottom; i++) {
+				auto item = oldRing->items[i & (oldRing->len - 1)].load(std::memory_order_relaxed);
+				r->items[i & (r->len - 1)].store(item, std::memory_order_relaxed);
+			}
+			
+			oldRings.push(oldRing);
+			ring.store(r, std::memory_order_release);
+			return r;
+		}
+		
+	};
+}
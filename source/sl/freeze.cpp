@@ -0,0 +1,67 @@
+#include "freeze.h"
+
+#include <unordered_set>
+
+#include "array.h"
+#include "darray.h"
+#include "struct.h"
+
+namespace SL {
+	bool freezeVal(Val val) {
+		// Gather everything not yet frozen first, so nothing is
+		// frozen if a thread turns up
+		std::unordered_set<Object*> seen;
+		DArray<Val> pending, toFreeze;
+		pending.init(16);
+		toFreeze.init(16);
+		
+		auto ok = true;
+		pending.push(val);
+		while (pending.len > 0 && ok) {
+			auto v = pending.pop();
+			if (v.isThread()) {
+				ok = false;
+				break;
+			}
+			if (!v.isString() && !v.isArray() && !v.isStruct()) {
+				continue;
+			}
+			
+			auto object = (Object*)v.ptrVal;
+			if (object->isFrozen || !seen.insert(object).second) {
+				continue;
+			}
+			toFreeze.push(v);
+			
+			if (v.isArray()) {
+				auto array = v.arrayVal;
+				for (auto i = size_t(0); i < array->nElems; i++) {
+					pending.push(array->elems[i]);
+				}
+			} else if (v.isStruct()) {
+				auto s = v.structVal;
+				for (auto i = size_t(0); i < s->nSlots; i++) {
+					if (s->slotIsOccupied(i)) {
+						pending.push(Val::newString(s->keys[i]));
+						pending.push(s->vals[i]);
+					}
+				}
+			}
+		}
+		
+		if (ok) {
+			for (auto i = size_t(0); i < toFreeze.len; i++) {
+				auto v = toFreeze.buf[i];
+				if (v.isString()) {
+					v.stringVal->flatten();
+					v.stringVal->hash();
+				}
+				((Object*)v.ptrVal)->isFrozen = true;
+			}
+		}
+		
+		toFreeze.deinit();
+		pending.deinit();
+		return ok;
+	}
+}
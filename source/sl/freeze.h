@@ -0,0 +1,12 @@
+#pragma once
+
+#include "val.h"
+
+namespace SL {
+	// Make a value and everything reachable from it immutable, so it can
+	// be shared between threads without copying. Strings are flattened
+	// and hashed first, as those are the only writes to them. Functions
+	// are immutable already, and channels are safe to share. Returns
+	// false, freezing nothing, if a thread is reachable.
+	bool freezeVal(Val val);
+}
@@ -1,9 +1,48 @@
 #include "func.h"
 
+#include "funcinfo.h"
 #include "heap.h"
 
 namespace SL {
 	Func *Func::create(Heap *heap) {
-		return (Func*)heap->createObject(sizeof(Func), objectTypeFunc);
+		auto r = (Func*)heap->createObject(sizeof(Func), objectTypeFunc);
+		r->native = nullptr;
+		
+		return r;
+	}
+	
+	Func *Func::createNative(Heap *heap, NativeFn native) {
+		auto r = (Func*)heap->createObject(sizeof(Func), objectTypeFunc);
+		r->native = native;
+		r->nConsts = 0;
+		r->consts = nullptr;
+		r->nOps = 0;
+		r->ops = nullptr;
+		r->nParams = 0;
+		r->nLocals = 0;
+		r->name = nullptr;
+		r->file = nullptr;
+		r->nLineSpans = 0;
+		r->lineSpans = nullptr;
+		r->info = nativeFuncInfo;
+		
+		// Holds no values, so is immutable
+		r->isFrozen = true;
+		
+		return r;
+	}
+	
+	size_t Func::getLine(size_t opIdx) const {
+		// Find the last span starting at or before the op
+		auto lo = size_t(0), hi = nLineSpans;
+		while (lo < hi) {
+			auto mid = lo + (hi - lo) / 2;
+			if (lineSpans[mid].firstOp <= opIdx) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo > 0? lineSpans[lo - 1].line : 0;
 	}
 }
@@ -9,6 +9,9 @@ namespace SL {
 	enum Opcode : uint8_t {
 		opcodeGetInst,
 		opcodeGetGlobal,
+		// Get and set globals by the slots of their names (see globals.h)
+		opcodeGetGlobalSlot,
+		opcodeSetGlobalSlot,
 		opcodeGetConst,
 		opcodeGetVar,
 		opcodeSetVar,
@@ -42,8 +45,15 @@ namespace SL {
 		opcodeJmp,
 		opcodeJmpN,
 		
+		opcodeIterInit,
+		opcodeIterNext,
+		
 		opcodeCall,
 		opcodeInstCall,
+		// Calls whose result is returned straight away, which
+		// take the place of the call making them
+		opcodeTailCall,
+		opcodeTailInstCall,
 		opcodeRet,
 	};
 	
@@ -52,8 +62,29 @@ namespace SL {
 	};
 	
 	struct Val;
+	struct Thread;
+	struct String;
+	
+	// Start of a run of ops compiled from the same line
+	struct LineSpan {
+		uint32_t firstOp;
+		uint32_t line;
+	};
 	
+	// Function implemented by the host. args points into the thread's
+	// stack, which may be reallocated if the function calls back into
+	// the thread, so copy out any arguments that are needed afterwards.
+	// Returning false aborts the script.
+	using NativeFn = bool (*)(Thread *thread, Val inst, size_t nArgs, Val const *args, Val *oResult);
+	
+	// Functions are frozen once created. Compiled ones belong to the
+	// shared group they were compiled into, and natives to the heap that
+	// created them, which shares copies of them with other heaps.
 	struct Func : public Object {
+		// If non-null, the function is implemented by the host
+		// and has no consts or ops
+		NativeFn native;
+		
 		size_t nConsts;
 		Val *consts;
 		
@@ -62,6 +93,25 @@ namespace SL {
 		
 		size_t nParams, nLocals;
 		
+		// Name the function was given where it was defined (by the
+		// variable, key, or field it was assigned to), and the file
+		// it was compiled from. Null for native functions.
+		String *name;
+		String *file;
+		
+		// Lines the ops were compiled from, in order of firstOp
+		size_t nLineSpans;
+		LineSpan *lineSpans;
+		
+		// Number of a copy of the name, file, and lines kept after the
+		// function is freed (see funcinfo.h), shared by all natives
+		uint32_t info;
+		
+		// Line (counting from 1) that the op at opIdx was compiled
+		// from, or 0 if not known
+		size_t getLine(size_t opIdx) const;
+		
 		static Func *create(Heap *heap);
+		static Func *createNative(Heap *heap, NativeFn native);
 	};
 }
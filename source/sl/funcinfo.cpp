@@ -0,0 +1,70 @@
+#include "funcinfo.h"
+
+#include <cassert>
+#include <deque>
+#include <mutex>
+
+#include "val.h"
+
+namespace SL {
+	// Info numbered so far, by number, in a deque so it stays where
+	// it is as more is added. Natives share the first.
+	static std::mutex allFuncInfoMutex;
+	static std::deque<FuncInfo> allFuncInfo = {FuncInfo{.name = "<native>"}};
+	
+	size_t FuncInfo::getLine(size_t opIdx) const {
+		// Find the last span starting at or before the op
+		auto lo = size_t(0), hi = lineSpans.size();
+		while (lo < hi) {
+			auto mid = lo + (hi - lo) / 2;
+			if (lineSpans[mid].firstOp <= opIdx) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo > 0? lineSpans[lo - 1].line : 0;
+	}
+	
+	uint32_t addFuncInfo(Func *func) {
+		assert(func->native == nullptr);
+		
+		auto info = FuncInfo{
+			.name = std::string(func->name->getChars(), func->name->nChars),
+			.file = std::string(func->file->getChars(), func->file->nChars),
+			.lineSpans = std::vector<LineSpan>(func->lineSpans, func->lineSpans + func->nLineSpans),
+		};
+		
+		std::lock_guard<std::mutex> lock(allFuncInfoMutex);
+		assert(allFuncInfo.size() < UINT32_MAX);
+		allFuncInfo.push_back(std::move(info));
+		return uint32_t(allFuncInfo.size() - 1);
+	}
+	
+	FuncInfo const *getFuncInfo(uint32_t id) {
+		std::lock_guard<std::mutex> lock(allFuncInfoMutex);
+		assert(id < allFuncInfo.size());
+		return &allFuncInfo[id];
+	}
+	
+	void appendFuncLocation(std::string *str, uint32_t funcInfo, size_t line) {
+		if (funcInfo == nativeFuncInfo) {
+			*str += "<native>";
+			return;
+		}
+		
+		auto appendChars = [&](std::string const &chars) {
+			for (auto c: chars) {
+				*str += (c == ';' || c == ' ' || c == '\n' || c == '\r' || c == '\t')? '_' : c;
+			}
+		};
+		
+		auto info = getFuncInfo(funcInfo);
+		appendChars(info->name);
+		*str += " (";
+		appendChars(info->file);
+		*str += ':';
+		*str += std::to_string(line);
+		*str += ')';
+	}
+}
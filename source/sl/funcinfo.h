@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "func.h"
+
+namespace SL {
+	// Name, file, and lines of a compiled function, kept for as long as
+	// the process runs, so that profiles and allocation stats can name
+	// functions that have since been freed, or whose memory has been
+	// reused by others
+	struct FuncInfo {
+		std::string name, file;
+		std::vector<LineSpan> lineSpans;
+		
+		// As Func::getLine
+		size_t getLine(size_t opIdx) const;
+	};
+	
+	// Info of every native function
+	static constexpr uint32_t nativeFuncInfo = 0;
+	
+	// Number the info of a compiled function, once its name,
+	// file, and lines are set
+	uint32_t addFuncInfo(Func *func);
+	// Info numbered id, which stays where it is
+	FuncInfo const *getFuncInfo(uint32_t id);
+	
+	// Append the function's name, file, and a line in it, as "name
+	// (file:line)", leaving out the characters that separate frames
+	// and counts in folded stacks
+	void appendFuncLocation(std::string *str, uint32_t funcInfo, size_t line);
+}
@@ -0,0 +1,36 @@
+#include "globals.h"
+
+#include <cassert>
+#include <deque>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+namespace SL {
+	// Names numbered so far, by slot, in a deque so they stay
+	// where they are as more are added
+	static std::mutex allNamesMutex;
+	static std::deque<std::string> allNames;
+	static std::unordered_map<std::string_view, uint32_t> allNameSlots;
+	
+	uint32_t getGlobalSlot(size_t nChars, char const *chars) {
+		std::lock_guard<std::mutex> lock(allNamesMutex);
+		auto it = allNameSlots.find(std::string_view(chars, nChars));
+		if (it != allNameSlots.end()) {
+			return it->second;
+		}
+		
+		// Slots must fit in an op's arg
+		assert(allNames.size() < (size_t(1) << 23));
+		auto r = uint32_t(allNames.size());
+		auto &name = allNames.emplace_back(chars, nChars);
+		allNameSlots[name] = r;
+		return r;
+	}
+	
+	std::string const *getGlobalName(uint32_t slot) {
+		std::lock_guard<std::mutex> lock(allNamesMutex);
+		assert(slot < allNames.size());
+		return &allNames[slot];
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace SL {
+	// Global names are numbered as they're compiled, once for the whole
+	// process, so that a name's slot means the same to every isolate,
+	// as compiled functions can be shared between them. Ops refer to
+	// globals by slot, and threads find where the key of each slot is
+	// in their global struct, which holds the values.
+	uint32_t getGlobalSlot(size_t nChars, char const *chars);
+	// Name of the global in slot, which stays valid
+	// for as long as the process runs
+	std::string const *getGlobalName(uint32_t slot);
+}
@@ -1,12 +1,415 @@
 #include "heap.h"
 
 #include <cassert>
+#include <cstdint>
+#include <new>
+
+#include "allocstats.h"
+#include "array.h"
+#include "channel.h"
+#include "collector.h"
+#include "darray.h"
+#include "func.h"
+#include "profiler.h"
+#include "struct.h"
+#include "thread.h"
+#include "val.h"
 
 namespace SL {
+	// Heaps with fewer objects than this are never collected
+	static constexpr size_t minCollectThreshold = size_t(1) << 16;
+	
+	// Nor collected for holding more shared groups than this, as each
+	// one collected gives back more memory than an object does
+	static constexpr size_t minCollectSharedGroups = size_t(1) << 10;
+	
 	Object *Heap::createObject(size_t size, ObjectType type) {
 		assert(size >= sizeof(Object));
+		reserveBytes(size);
 		auto r = (Object*)::operator new(size);
 		r->type = type;
+		r->isFrozen = false;
+		r->owner = objectOwner;
+		r->isMarked.store(false, std::memory_order_relaxed);
+		r->isInRegion = false;
+		r->isForwarded = false;
+		r->allocSite = trackObjectAlloc(type, size);
+		
+		switch (objectOwner) {
+		case objectOwnerHeap: {
+			r->next = objects;
+			objects = r;
+			nObjects++;
+			break;
+		}
+		case objectOwnerTransit: {
+			r->next = nullptr;
+			break;
+		}
+		case objectOwnerShared: {
+			r->group = sharedGroup;
+			sharedGroup->objects.push(r);
+			break;
+		}
+		}
+		return r;
+	}
+	
+	// Push the objects val references, or that an object in transit
+	// does, for adopt or destroyTransit to visit
+	static void pushTransitVal(DArray<Object*> *pending, Val val) {
+		if (val.isString() || val.isArray() || val.isStruct() || val.isFunc() || val.isChannel()) {
+			pending->push((Object*)val.ptrVal);
+		}
+	}
+	static void pushTransitRefs(DArray<Object*> *pending, Object *object) {
+		if (object->type == objectTypeArray) {
+			auto array = (Array*)object;
+			for (auto i = size_t(0); i < array->nElems; i++) {
+				pushTransitVal(pending, array->elems[i]);
+			}
+		} else if (object->type == objectTypeStruct) {
+			auto s = (Struct*)object;
+			for (auto i = size_t(0); i < s->nSlots; i++) {
+				if (s->slotIsOccupied(i)) {
+					pending->push(s->keys[i]);
+					pushTransitVal(pending, s->vals[i]);
+				}
+			}
+		}
+	}
+	
+	void Heap::adopt(Val val) {
+		DArray<Object*> pending;
+		pending.init(16);
+		pushTransitVal(&pending, val);
+		
+		// Changing the owner on the way also marks objects as visited.
+		// Each reference to a shared object holds a reference to its
+		// group, whichever object it's from.
+		while (pending.len > 0) {
+			auto object = pending.pop();
+			if (object->owner == objectOwnerShared) {
+				holdSharedGroup(object->group);
+				continue;
+			} else if (object->owner != objectOwnerTransit) {
+				continue;
+			}
+			
+			object->owner = objectOwnerHeap;
+			object->next = objects;
+			objects = object;
+			nObjects++;
+			addBytes(getObjectSize(object));
+			pushTransitRefs(&pending, object);
+		}
+		
+		pending.deinit();
+	}
+	
+	void Heap::holdSharedGroup(SharedGroup *group) {
+		// Groups are often handed over several times in a row
+		if (sharedGroups.len > 0 && sharedGroups.buf[sharedGroups.len - 1] == group) {
+			group->release();
+			return;
+		}
+		
+		sharedGroups.push(group);
+		addBytes(group->nBytes);
+		if (sharedGroups.len >= collectSharedGroups) {
+			collectThreshold = 0;
+		}
+	}
+	
+	void Heap::makeRoom(size_t n) {
+		auto held = nBytes.load(std::memory_order_relaxed);
+		auto isOver = held > maxBytes || n > maxBytes - held;
+		if (isOver && collector && rootThread && nCallbacks == 0) {
+			collect();
+		}
+	}
+	
+	void Heap::collect() {
+		assert(collector != nullptr && rootThread != nullptr);
+		collector->collect(this);
+		nBytes.store(liveBytes + sharedBytes, std::memory_order_relaxed);
+		updateHeapCensus(this);
+		
+		// Collect again once the heap has doubled since
+		collectThreshold = nObjects * 2;
+		if (collectThreshold < minCollectThreshold) {
+			collectThreshold = minCollectThreshold;
+		}
+		collectSharedGroups = sharedGroups.len * 2;
+		if (collectSharedGroups < minCollectSharedGroups) {
+			collectSharedGroups = minCollectSharedGroups;
+		}
+		setMaxBytes(maxBytes);
+	}
+	
+	void Heap::setMaxBytes(size_t maxBytes) {
+		this->maxBytes = maxBytes;
+		
+		auto held = nBytes.load(std::memory_order_relaxed);
+		if (!collector || maxBytes == SIZE_MAX) {
+			collectBytes = SIZE_MAX;
+		} else if (held >= maxBytes) {
+			collectBytes = held;
+		} else {
+			collectBytes = held + (maxBytes - held) / 2;
+		}
+	}
+	
+	void Heap::init(Collector *collector) {
+		this->collector = collector;
+		rootThread = nullptr;
+		objects = nullptr;
+		nObjects = 0;
+		collectThreshold = collector? minCollectThreshold : SIZE_MAX;
+		nBytes.store(0, std::memory_order_relaxed);
+		maxBytes = SIZE_MAX;
+		collectBytes = SIZE_MAX;
+		regions = nullptr;
+		liveBytes = 0;
+		peakBytes = 0;
+		sharedBytes = 0;
+		nNativeCalls = 0;
+		nCallbacks = 0;
+		isSweepPending = false;
+		sweepObjects = nullptr;
+		keptObjects = nullptr;
+		lastKeptObject = nullptr;
+		sweptBytes = 0;
+		objectOwner = objectOwnerHeap;
+		sharedGroup = nullptr;
+		sharedGroups.init(16);
+		collectSharedGroups = collector? minCollectSharedGroups : SIZE_MAX;
+		sharedCopies.clear();
+		peakCensus = nullptr;
+	}
+	
+	void Heap::initTransit() {
+		init(nullptr);
+		objectOwner = objectOwnerTransit;
+	}
+	
+	void Heap::initShared() {
+		init(nullptr);
+		objectOwner = objectOwnerShared;
+		sharedGroup = SharedGroup::create();
+	}
+	
+	void Heap::deinit() {
+		if (collector) {
+			collector->finishSweep(this);
+		}
+		
+		for (auto object = objects; object;) {
+			auto next = object->next;
+			auto isPinned = object->type == objectTypeThread && ((Thread*)object)->task;
+			if (!isPinned) {
+				destroyObject(object);
+			}
+			object = next;
+		}
+		objects = nullptr;
+		nObjects = 0;
+		
+		for (auto region = regions; region;) {
+			auto next = region->next;
+			Region::destroy(region);
+			region = next;
+		}
+		regions = nullptr;
+		
+		for (auto i = size_t(0); i < sharedGroups.len; i++) {
+			sharedGroups.buf[i]->release();
+		}
+		sharedGroups.deinit();
+		for (auto &[original, copy]: sharedCopies) {
+			copy->group->release();
+		}
+		sharedCopies.clear();
+		if (sharedGroup) {
+			sharedGroup->nBytes = nBytes.load(std::memory_order_relaxed);
+			sharedGroup->release();
+			sharedGroup = nullptr;
+		}
+		
+		destroyHeapCensus(peakCensus);
+		peakCensus = nullptr;
+	}
+	
+	void SharedGroup::release() {
+		if (nRefs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+			return;
+		}
+		
+		// Freeing a group drops its references to others,
+		// which may leave them to be freed as well
+		DArray<SharedGroup*> pending;
+		pending.init(4);
+		pending.push(this);
+		while (pending.len > 0) {
+			auto group = pending.pop();
+			for (auto i = size_t(0); i < group->objects.len; i++) {
+				destroyObject(group->objects.buf[i]);
+			}
+			for (auto i = size_t(0); i < group->groups.len; i++) {
+				auto other = group->groups.buf[i];
+				if (other->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					pending.push(other);
+				}
+			}
+			
+			group->objects.deinit();
+			group->groups.deinit();
+			delete group;
+		}
+		pending.deinit();
+	}
+	
+	SharedGroup *SharedGroup::create() {
+		auto r = new SharedGroup;
+		r->nRefs.store(1, std::memory_order_relaxed);
+		r->objects.init(16);
+		r->groups.init(4);
+		r->nBytes = 0;
+		return r;
+	}
+	
+	Region *Region::create() {
+		auto r = (Region*)::operator new(size, std::align_val_t(size));
+		r->next = nullptr;
+		r->used = sizeof(Region);
 		return r;
 	}
+	
+	void Region::destroy(Region *region) {
+		::operator delete(region, std::align_val_t(size));
+	}
+	
+	void destroyObject(Object *object) {
+		switch (object->type) {
+		case objectTypeString: {
+			// Characters are stored inline unless flattened later
+			auto str = (String*)object;
+			if (str->chars != (char*)(str + 1)) {
+				delete[] str->chars;
+			}
+			break;
+		}
+		case objectTypeArray: {
+			auto array = (Array*)object;
+			if (!array->hasInlineElems()) {
+				delete[] array->elems;
+			}
+			break;
+		}
+		case objectTypeStruct: {
+			// Slots share one allocation, starting with the keys
+			auto s = (Struct*)object;
+			if (!s->hasInlineSlots()) {
+				delete[] (char*)s->keys;
+			}
+			break;
+		}
+		case objectTypeFunc: {
+			auto func = (Func*)object;
+			delete[] func->consts;
+			delete[] func->ops;
+			delete[] func->lineSpans;
+			break;
+		}
+		case objectTypeThread: {
+			((Thread*)object)->deinit();
+			break;
+		}
+		case objectTypeChannel: {
+			// Nothing else can be using the channel by now. Values
+			// still in it are left to no one, and it was allocated
+			// over-aligned, so is deleted as what it is.
+			auto ch = (Channel*)object;
+			auto receivePos = ch->receivePos.load(std::memory_order_relaxed);
+			auto sendPos = ch->sendPos.load(std::memory_order_relaxed);
+			for (auto pos = receivePos; pos != sendPos; pos++) {
+				destroyTransit(ch->cells[pos & (ch->nCells - 1)].val);
+			}
+			delete[] ch->cells;
+			delete ch;
+			return;
+		}
+		}
+		if (!object->isInRegion) {
+			::operator delete(object);
+		}
+	}
+	
+	void destroyTransit(Val val) {
+		DArray<Object*> pending, found;
+		pending.init(16);
+		found.init(16);
+		pushTransitVal(&pending, val);
+		
+		// As with adopt, changing the owner marks objects as visited,
+		// and references to shared objects each hold one to the group.
+		// Objects are only freed once all have been visited.
+		while (pending.len > 0) {
+			auto object = pending.pop();
+			if (object->owner == objectOwnerShared) {
+				object->group->release();
+				continue;
+			} else if (object->owner != objectOwnerTransit) {
+				continue;
+			}
+			
+			object->owner = objectOwnerHeap;
+			found.push(object);
+			pushTransitRefs(&pending, object);
+		}
+		
+		for (auto i = size_t(0); i < found.len; i++) {
+			destroyObject(found.buf[i]);
+		}
+		found.deinit();
+		pending.deinit();
+	}
+	
+	size_t getObjectSize(Object *object) {
+		switch (object->type) {
+		case objectTypeString: {
+			auto str = (String*)object;
+			return sizeof(String) + (str->isFlat()? str->nChars + 1 : 0);
+		}
+		case objectTypeArray: {
+			return sizeof(Array) + sizeof(Val) * ((Array*)object)->bufLen;
+		}
+		case objectTypeStruct: {
+			return sizeof(Struct) + Struct::getSlotsSize(((Struct*)object)->nSlots);
+		}
+		case objectTypeFunc: {
+			auto func = (Func*)object;
+			return sizeof(Func) + sizeof(Val) * func->nConsts + sizeof(Op) * func->nOps +
+				sizeof(LineSpan) * func->nLineSpans;
+		}
+		case objectTypeThread: {
+			auto thread = (Thread*)object;
+			if (thread->task) {
+				return sizeof(Thread);
+			}
+			return sizeof(Thread) + sizeof(Val) * thread->stack.bufLen + sizeof(Call) * thread->callStack.bufLen +
+				thread->getGlobalPossSize();
+		}
+		case objectTypeChannel: {
+			return sizeof(Channel) + sizeof(Channel::Cell) * ((Channel*)object)->nCells;
+		}
+		}
+		return 0;
+	}
+	
+	void reserveRunningHeapBytes(size_t n) {
+		if (runningThread) {
+			runningThread->heap->reserveBytes(n);
+		}
+	}
 }
@@ -1,24 +1,301 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "darray.h"
 
 namespace SL {
-	enum ObjectType {
+	struct SharedGroup;
+	
+	enum ObjectType : uint8_t {
 		objectTypeString,
 		objectTypeArray,
 		objectTypeStruct,
 		objectTypeFunc,
 		objectTypeThread,
+		objectTypeChannel,
+	};
+	
+	// What an object belongs to, which frees it once unreachable
+	enum ObjectOwner : uint8_t {
+		// The heap whose list it is in
+		objectOwnerHeap,
+		// No heap yet, as it was created by moveVal, until
+		// adopted by the heap receiving it
+		objectOwnerTransit,
+		// A group of objects shared between heaps
+		objectOwnerShared,
 	};
 	
 	struct Object {
 		ObjectType type;
+		
+		// Set by freezeVal. Frozen objects are never written to again,
+		// so can be read by any number of threads at once.
+		bool isFrozen;
+		
+		ObjectOwner owner;
+		
+		// Set while collecting on objects found to be reachable
+		std::atomic<bool> isMarked;
+		
+		// Set on objects compacted into one of their heap's regions,
+		// which are freed along with the region rather than one by one
+		bool isInRegion;
+		
+		// Set while compacting on objects that have been moved, whose
+		// next then points to the copy
+		bool isForwarded;
+		
+		// Where the object was created, while allocations are
+		// tracked (see allocstats.h)
+		uint16_t allocSite;
+		
+		union {
+			// Next object in its heap's list
+			Object *next;
+			// Group a shared object belongs to
+			SharedGroup *group;
+		};
+	};
+	
+	// Thrown by allocations that would take a heap over its limit, and
+	// by collections that leave it over, to be caught by the VM, which
+	// aborts the script
+	struct HeapLimitError {};
+	
+	struct Collector;
+	struct HeapCensus;
+	struct Thread;
+	struct Val;
+	
+	// Block of memory that compaction packs objects into, each along
+	// with its buffers. Regions are aligned to their size, so the one
+	// holding an object can be found from its address.
+	struct Region {
+		static constexpr size_t size = size_t(1) << 18;
+		
+		Region *next;
+		
+		// Bytes used, including this header
+		size_t used;
+		
+		static Region *of(void const *p) {
+			return (Region*)(uintptr_t(p) & ~uintptr_t(size - 1));
+		}
+		
+		static Region *create();
+		static void destroy(Region *region);
 	};
 	
+	// Frozen objects shared between heaps, freed together once nothing
+	// holds a reference to the group. Functions are compiled into a
+	// group, and frozen values handed from one heap to another are
+	// copied into one (see copyVal). Each channel is a group of its
+	// own, whose values in transit hold their own references.
+	//
+	// Each heap holds a reference to the groups it reaches, and each
+	// group to the other groups its objects reach, as do values in
+	// transit. Objects only ever reach objects of their own group or
+	// of those it holds, so no heap's collector has to look inside.
+	struct SharedGroup {
+		std::atomic<size_t> nRefs;
+		
+		DArray<Object*> objects;
+		DArray<SharedGroup*> groups;
+		
+		// Bytes held by the objects, counted once the heap creating
+		// them is done, and held against the limits of the heaps
+		// holding the group
+		size_t nBytes;
+		
+		void acquire() {
+			nRefs.fetch_add(1, std::memory_order_relaxed);
+		}
+		void release();
+		
+		// Created with one reference, for the caller
+		static SharedGroup *create();
+	};
+	
+	// Objects are allocated individually, and linked into a list so
+	// the collector can free the unreachable ones. A compacting
+	// collector also moves strings, arrays, and structs into regions,
+	// once freed objects leave too much of the memory held unused.
+	//
+	// Other heaps are only handed frozen objects through copies in
+	// shared groups, so frozen objects are collected like any other.
+	// Threads running spawned tasks belong to their spawner's heap,
+	// and aren't freed until joined.
 	struct Heap {
+		// Frees unreachable objects, or null to never collect
+		Collector *collector;
+		
+		// Thread whose stack, calls, and globals (and through them, any
+		// coroutines) hold everything reachable. Must be set before
+		// the heap can be collected.
+		Thread *rootThread;
+		
+		// Objects belonging to the heap, newest first
+		Object *objects;
+		size_t nObjects;
+		
+		// Number of objects at which to collect next, dropped to 0
+		// once the bytes allocated make a collection due
+		size_t collectThreshold;
+		
+		// Bytes held by the objects found reachable by the last collection
+		// and their buffers, and everything allocated since, garbage
+		// included. Only written by the heap's thread, but can be read
+		// from any, to be reported as a metric.
+		std::atomic<size_t> nBytes;
+		
+		// Most bytes the heap can hold, or SIZE_MAX for no limit. Heaps
+		// nearing their limit are collected more often, as collections
+		// are also made due once half the room left after the last one
+		// has been used, at collectBytes.
+		size_t maxBytes;
+		size_t collectBytes;
+		
+		// Regions objects have been compacted into, newest first
+		Region *regions;
+		
+		// Bytes held by the objects found reachable by the last
+		// collection, and the most held at once (garbage included)
+		// since the heap was last compacted. Memory freed since the
+		// peak can be reused by the heap, but not returned to the
+		// system while reachable objects are scattered through it.
+		size_t liveBytes, peakBytes;
+		
+		// Bytes of the shared groups the last collection found the heap
+		// reaching, or holding copies of its objects in, which count
+		// against its limit along with liveBytes. Groups held since are
+		// added as they are.
+		size_t sharedBytes;
+		
+		// Number of native functions running on the heap's threads,
+		// and of calls back into the VM made by them. The C++ frames of
+		// natives that have called back may hold values the collector
+		// can't see, so it doesn't run while there are any.
+		size_t nNativeCalls, nCallbacks;
+		
+		// Objects handed to the collector to sweep, and those of them
+		// still reachable once it has, to be put back in the list. Only
+		// accessed by the collector while isSweepPending.
+		bool isSweepPending;
+		Object *sweepObjects;
+		Object *keptObjects, *lastKeptObject;
+		size_t sweptBytes;
+		
+		// Owner of the objects the heap creates: the heap itself, no heap
+		// until adopted, or sharedGroup, which the heap holds a reference
+		// to until deinited
+		ObjectOwner objectOwner;
+		SharedGroup *sharedGroup;
+		
+		// Groups of shared objects the heap may reach, each holding a
+		// reference. Each collection replaces them with those found
+		// reachable, and collections are due once their number has
+		// doubled since, at collectSharedGroups. In between, groups
+		// handed over again may be in more than once.
+		DArray<SharedGroup*> sharedGroups;
+		size_t collectSharedGroups;
+		
+		// Copies of the heap's objects in shared groups, by original, so
+		// that sharing an object again reuses its copy. Each holds a
+		// reference to its group, dropped by the collection that finds
+		// the original unreachable.
+		std::unordered_map<Object*, Object*> sharedCopies;
+		
+		// Objects found reachable by the collection that found the most
+		// bytes reachable, by site and type, while allocations are
+		// tracked (see allocstats.h)
+		HeapCensus *peakCensus;
+		
 		Object *createObject(size_t size, ObjectType type);
 		
-		void init() { }
-		void deinit() { }
+		// Count n bytes about to be allocated for an object or buffer,
+		// throwing HeapLimitError if the heap can't hold them
+		void reserveBytes(size_t n) {
+			auto held = nBytes.load(std::memory_order_relaxed);
+			if (held > maxBytes || n > maxBytes - held) {
+				throw HeapLimitError{};
+			}
+			addBytes(n);
+		}
+		// Count n bytes already allocated, such as those of objects
+		// adopted, which the next collection checks the limit against
+		void addBytes(size_t n) {
+			auto held = nBytes.load(std::memory_order_relaxed) + n;
+			nBytes.store(held, std::memory_order_relaxed);
+			if (held > collectBytes) {
+				collectThreshold = 0;
+			}
+		}
+		size_t getNBytes() const {
+			return nBytes.load(std::memory_order_relaxed);
+		}
+		void setMaxBytes(size_t maxBytes);
+		
+		// Link objects in transit reachable from val into the heap, which
+		// takes over the references it holds to shared groups
+		void adopt(Val val);
+		// Take over a reference to a group of shared objects
+		// the heap can now reach
+		void holdSharedGroup(SharedGroup *group);
+		// Collect if n more bytes would take the heap over its limit, so
+		// garbage isn't held against it. Only called where everything
+		// reachable is where the collector looks, such as by a native
+		// function about to allocate, holding nothing but its arguments.
+		void makeRoom(size_t n);
+		
+		// Whether there are enough new objects to be worth collecting,
+		// and no native functions in the way
+		bool isCollectDue() const {
+			return nObjects >= collectThreshold && nCallbacks == 0;
+		}
+		void collect();
+		// Collect, at one of the points the VM can abort the script
+		// from, throwing HeapLimitError if what's reachable is still
+		// more than the heap can hold
+		void collectWithinLimit() {
+			collect();
+			if (nBytes.load(std::memory_order_relaxed) > maxBytes) {
+				throw HeapLimitError{};
+			}
+		}
+		
+		// Share of the peak bytes held that the reachable
+		// objects don't need, from 0 to 1
+		double getFragmentation() const {
+			return peakBytes > liveBytes? 1.0 - double(liveBytes) / double(peakBytes) : 0.0;
+		}
+		
+		void init(Collector *collector);
+		// Heap whose objects belong to no heap until adopted
+		void initTransit();
+		// Heap whose objects belong to a new shared group
+		void initShared();
+		void deinit();
 	};
+	
+	// Free an object's own allocations, and then the object
+	void destroyObject(Object *object);
+	// Free the objects in transit reachable from val, which no heap
+	// will adopt, and drop the references it holds to shared groups
+	void destroyTransit(Val val);
+	
+	// Reserve n bytes for a buffer of an object that doesn't know its
+	// heap, from the heap of the thread running on this OS thread, which
+	// is the only one whose objects a script can be changing. Nothing is
+	// counted while no scripts are running.
+	void reserveRunningHeapBytes(size_t n);
+	
+	// Bytes held by an object and its own allocations. Tasks' threads
+	// count as their header only, as their stacks may be growing on
+	// another OS thread.
+	size_t getObjectSize(Object *object);
 }
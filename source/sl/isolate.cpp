@@ -0,0 +1,56 @@
+#include "isolate.h"
+
+#include "builtins.h"
+#include "compiler.h"
+#include "struct.h"
+
+namespace SL {
+	Func *Isolate::compile(char const *file, size_t nChars, char const *chars) {
+		// Compiled into a shared group of its own, which the heap
+		// holds on to while it can reach any of the functions
+		Heap codeHeap;
+		codeHeap.initShared();
+		auto r = Compiler{}.run(&codeHeap, file, nChars, chars);
+		
+		// Held once deinited, which counts the group's bytes
+		auto group = codeHeap.sharedGroup;
+		if (r) {
+			group->acquire();
+		}
+		codeHeap.deinit();
+		if (r) {
+			heap.holdSharedGroup(group);
+		}
+		
+		return r;
+	}
+	
+	bool Isolate::run(Func *func, Val *oResult) {
+		return thread->call(func, thread->global, 0, nullptr, oResult);
+	}
+	
+	bool Isolate::isSuspended() const {
+		return thread->state == threadStateSuspended;
+	}
+	
+	bool Isolate::resume(Val *oResult) {
+		return thread->resume(Val::newNil(), oResult);
+	}
+	
+	void Isolate::init(Scheduler *scheduler, Collector *collector) {
+		heap.init(collector);
+		
+		auto global = Struct::create(&heap, 16);
+		addBuiltins(&heap, global);
+		
+		output.init(stdout);
+		thread = Thread::create(&heap, Val::newStruct(global), &output);
+		thread->scheduler = scheduler;
+		heap.rootThread = thread;
+	}
+	
+	void Isolate::deinit() {
+		output.deinit();
+		heap.deinit();
+	}
+}
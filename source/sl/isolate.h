@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+
+#include "collector.h"
+#include "func.h"
+#include "heap.h"
+#include "output.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "val.h"
+
+namespace SL {
+	// Independent instance of the VM, with its own heap, globals, and
+	// thread. Isolates share no mutable state, so separate isolates can
+	// run on separate OS threads at the same time.
+	//
+	// Functions are compiled into shared groups, so a function compiled
+	// by one isolate (or into any other shared group) can be run by many
+	// isolates at once, as long as its group outlives them.
+	struct Isolate {
+		Heap heap;
+		Output output;
+		
+		// Holds the globals, which the collector may move,
+		// so are only ever reached through it
+		Thread *thread;
+		
+		// Returns null and prints diagnostics if compilation fails
+		Func *compile(char const *file, size_t nChars, char const *chars);
+		// Call a function with the globals as its instance. If the thread
+		// runs out of fuel, returns with it suspended, to be resumed
+		// (after topping up its fuel) or cancelled before the next run.
+		bool run(Func *func, Val *oResult);
+		bool isSuspended() const;
+		bool resume(Val *oResult);
+		
+		// Tasks spawned by scripts are run by scheduler, and garbage is
+		// collected by collector, both of which can be shared between
+		// isolates
+		void init(Scheduler *scheduler, Collector *collector);
+		void deinit();
+	};
+}
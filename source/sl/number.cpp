@@ -0,0 +1,189 @@
+#include "number.h"
+
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace SL {
+	// Write the decimal digits of an unsigned integer,
+	// returns the end of the written characters
+	static char *formatUInt(uint64_t val, char *oChars) {
+		static char const digitPairs[] =
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+			
+		// Fill a scratch buffer from the end, two digits at a time
+		char buf[20];
+		auto it = buf + sizeof(buf);
+		while (val >= 100) {
+			auto pair = &digitPairs[(val % 100) * 2];
+			val /= 100;
+			*--it = pair[1];
+			*--it = pair[0];
+		}
+		if (val >= 10) {
+			auto pair = &digitPairs[val * 2];
+			*--it = pair[1];
+			*--it = pair[0];
+		} else {
+			*--it = char('0' + val);
+		}
+		
+		auto nChars = size_t(buf + sizeof(buf) - it);
+		memcpy(oChars, it, nChars);
+		return oChars + nChars;
+	}
+	
+	size_t formatNumber(double val, char *oChars) {
+		auto it = oChars;
+		
+		if (std::isnan(val)) {
+			memcpy(it, "nan", 3);
+			return 3;
+		}
+		
+		if (std::signbit(val)) {
+			*it++ = '-';
+			val = -val;
+		}
+		
+		if (std::isinf(val)) {
+			memcpy(it, "inf", 3);
+			return size_t(it + 3 - oChars);
+		}
+		
+		// Integers that are exactly representable are the common case,
+		// and need no digit generation beyond an integer conversion
+		if (val < 9007199254740992.0 && val == double(uint64_t(val))) {
+			it = formatUInt(uint64_t(val), it);
+			return size_t(it - oChars);
+		}
+		
+		// Generate the shortest round-trip digits in the form d.ddde[+-]x
+		char sci[maxNumberNChars];
+		auto sciEnd = std::to_chars(sci, sci + sizeof(sci), val, std::chars_format::scientific).ptr;
+		
+		char digits[20];
+		auto nDigits = size_t(0);
+		auto sciIt = sci;
+		digits[nDigits++] = *sciIt++;
+		if (*sciIt == '.') {
+			sciIt++;
+			while (*sciIt != 'e') {
+				digits[nDigits++] = *sciIt++;
+			}
+		}
+		sciIt++;
+		
+		auto expIsNeg = *sciIt++ == '-';
+		auto exp = 0;
+		while (sciIt < sciEnd) {
+			exp = exp*10 + (*sciIt++ - '0');
+		}
+		if (expIsNeg) {
+			exp = -exp;
+		}
+		
+		if (exp >= -6 && exp < 21) {
+			if (exp < 0) {
+				// 0.000ddd
+				*it++ = '0';
+				*it++ = '.';
+				for (auto i = -1; i > exp; i--) {
+					*it++ = '0';
+				}
+				memcpy(it, digits, nDigits);
+				it += nDigits;
+			} else if (size_t(exp) + 1 >= nDigits) {
+				// ddd000
+				memcpy(it, digits, nDigits);
+				it += nDigits;
+				for (auto i = nDigits; i < size_t(exp) + 1; i++) {
+					*it++ = '0';
+				}
+			} else {
+				// ddd.ddd
+				memcpy(it, digits, exp + 1);
+				it += exp + 1;
+				*it++ = '.';
+				memcpy(it, digits + exp + 1, nDigits - exp - 1);
+				it += nDigits - exp - 1;
+			}
+		} else {
+			// d.ddde[+-]xx
+			*it++ = digits[0];
+			if (nDigits > 1) {
+				*it++ = '.';
+				memcpy(it, digits + 1, nDigits - 1);
+				it += nDigits - 1;
+			}
+			*it++ = 'e';
+			*it++ = (exp < 0)? '-' : '+';
+			if (exp < 0) {
+				exp = -exp;
+			}
+			if (exp < 10) {
+				*it++ = '0';
+			}
+			it = formatUInt(uint64_t(exp), it);
+		}
+		
+		assert(size_t(it - oChars) <= maxNumberNChars);
+		return size_t(it - oChars);
+	}
+	
+	double parseNumber(size_t nChars, char const *chars) {
+		// Powers of 10 that are exactly representable as doubles
+		static double const exactPowersOf10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+		};
+		
+		// If the significant digits fit exactly in a double and the
+		// divisor is an exact power of 10, a single division is
+		// correctly rounded
+		auto mantissa = uint64_t(0);
+		auto nSigDigits = size_t(0), nFracDigits = size_t(0);
+		auto inFrac = false;
+		for (auto i = size_t(0); i < nChars; i++) {
+			auto c = chars[i];
+			if (c == '.') {
+				inFrac = true;
+				continue;
+			}
+			
+			assert(c >= '0' && c <= '9');
+			if (mantissa != 0 || c != '0') {
+				nSigDigits++;
+			}
+			if (nSigDigits > 19) {
+				break;
+			}
+			
+			mantissa = mantissa*10 + uint64_t(c - '0');
+			if (inFrac) {
+				nFracDigits++;
+			}
+		}
+		
+		if (nSigDigits <= 19 && mantissa <= (uint64_t(1) << 53) &&
+			nFracDigits < sizeof(exactPowersOf10) / sizeof(double)
+		) {
+			return double(mantissa) / exactPowersOf10[nFracDigits];
+		}
+		
+		double r;
+		std::from_chars(chars, chars + nChars, r);
+		return r;
+	}
+}
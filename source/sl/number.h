@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+namespace SL {
+	// Maximum number of characters written by formatNumber
+	constexpr size_t maxNumberNChars = 32;
+	
+	// Write the shortest representation of val that parses back to the
+	// same value, in fixed notation for magnitudes within [1e-6, 1e21)
+	// and scientific notation otherwise. Returns the number of characters
+	// written, which are not null-terminated.
+	size_t formatNumber(double val, char *oChars);
+	
+	// Parse a number constant of the form digits[.digits]
+	double parseNumber(size_t nChars, char const *chars);
+}
@@ -0,0 +1,206 @@
+#include "opstats.h"
+
+#ifdef SL_OPCODE_STATS
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SL_HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SL_HAS_RDTSC
+#endif
+
+namespace SL {
+	static char const *opcodeNames[] = {
+		"GetInst",
+		"GetGlobal",
+		"GetGlobalSlot",
+		"SetGlobalSlot",
+		"GetConst",
+		"GetVar",
+		"SetVar",
+		"GetElem",
+		"SetElem",
+		"Eat",
+		"Neg",
+		"Add",
+		"Sub",
+		"Mul",
+		"Div",
+		"Mod",
+		"CmpEq",
+		"CmpNEq",
+		"CmpLt",
+		"CmpGt",
+		"CmpLtEq",
+		"CmpGtEq",
+		"NotL",
+		"AndL",
+		"OrL",
+		"MakeArray",
+		"MakeStruct",
+		"Print",
+		"Jmp",
+		"JmpN",
+		"IterInit",
+		"IterNext",
+		"Call",
+		"InstCall",
+		"TailCall",
+		"TailInstCall",
+		"Ret",
+	};
+	static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == nOpcodes);
+	
+	// Number of the most common pairs to print
+	static constexpr size_t nPrintedPairs = 16;
+	
+	// Stats of every OS thread that has run ops, kept after
+	// the thread exits so its counts still add up
+	static std::mutex allStatsMutex;
+	static std::vector<OpStats*> allStats;
+	
+	static thread_local OpStats *threadStats = nullptr;
+	
+	static uint64_t measureTickOverhead() {
+		auto r = UINT64_MAX;
+		for (auto i = 0; i < 1000; i++) {
+			auto start = OpRecorder::readTicks();
+			auto ticks = OpRecorder::readTicks() - start;
+			if (ticks < r) {
+				r = ticks;
+			}
+		}
+		return r;
+	}
+	
+	void OpRecorder::init() {
+		if (!threadStats) {
+			threadStats = new OpStats();
+			std::lock_guard<std::mutex> lock(allStatsMutex);
+			allStats.push_back(threadStats);
+		}
+		
+		stats = threadStats;
+		prevOpcode = -1;
+		timedOpcode = -1;
+		timedStart = 0;
+		nUntilSample = sampleInterval;
+		
+		static auto overhead = measureTickOverhead();
+		tickOverhead = overhead;
+	}
+	
+	uint64_t OpRecorder::readTicks() {
+#ifdef SL_HAS_RDTSC
+		return __rdtsc();
+#else
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()
+		).count());
+#endif
+	}
+	
+	void printOpStats(FILE *stream) {
+		uint64_t counts[nOpcodes] = {};
+		uint64_t pairCounts[nOpcodes][nOpcodes] = {};
+		uint64_t nTimed[nOpcodes] = {};
+		uint64_t timedTicks[nOpcodes] = {};
+		
+		{
+			std::lock_guard<std::mutex> lock(allStatsMutex);
+			for (auto stats: allStats) {
+				for (auto i = size_t(0); i < nOpcodes; i++) {
+					counts[i] += stats->counts[i].load(std::memory_order_relaxed);
+					nTimed[i] += stats->nTimed[i].load(std::memory_order_relaxed);
+					timedTicks[i] += stats->timedTicks[i].load(std::memory_order_relaxed);
+					for (auto j = size_t(0); j < nOpcodes; j++) {
+						pairCounts[i][j] += stats->pairCounts[i][j].load(std::memory_order_relaxed);
+					}
+				}
+			}
+		}
+		
+		auto total = uint64_t(0), totalPairs = uint64_t(0);
+		for (auto i = size_t(0); i < nOpcodes; i++) {
+			total += counts[i];
+			for (auto j = size_t(0); j < nOpcodes; j++) {
+				totalPairs += pairCounts[i][j];
+			}
+		}
+		auto share = [](uint64_t n, uint64_t total) {
+			return total > 0? 100.0 * double(n) / double(total) : 0.0;
+		};
+		
+		// Most run first
+		std::vector<size_t> order;
+		for (auto i = size_t(0); i < nOpcodes; i++) {
+			if (counts[i] > 0) {
+				order.push_back(i);
+			}
+		}
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return counts[a] > counts[b];
+		});
+		
+#ifdef SL_HAS_RDTSC
+		fprintf(stream, "opcode       count          share    avg cycles\n");
+#else
+		fprintf(stream, "opcode       count          share    avg ns\n");
+#endif
+		for (auto i: order) {
+			fprintf(stream, "%-12s %-14llu %5.1f%%   ",
+				opcodeNames[i], (unsigned long long)counts[i], share(counts[i], total)
+			);
+			if (nTimed[i] > 0) {
+				fprintf(stream, "%.1f\n", double(timedTicks[i]) / double(nTimed[i]));
+			} else {
+				fprintf(stream, "-\n");
+			}
+		}
+		
+		std::vector<size_t> pairOrder;
+		for (auto i = size_t(0); i < nOpcodes * nOpcodes; i++) {
+			if (pairCounts[i / nOpcodes][i % nOpcodes] > 0) {
+				pairOrder.push_back(i);
+			}
+		}
+		std::sort(pairOrder.begin(), pairOrder.end(), [&](size_t a, size_t b) {
+			return pairCounts[a / nOpcodes][a % nOpcodes] > pairCounts[b / nOpcodes][b % nOpcodes];
+		});
+		if (pairOrder.size() > nPrintedPairs) {
+			pairOrder.resize(nPrintedPairs);
+		}
+		
+		fprintf(stream, "\nfirst        then         count          share\n");
+		for (auto i: pairOrder) {
+			auto first = i / nOpcodes, then = i % nOpcodes;
+			fprintf(stream, "%-12s %-12s %-14llu %5.1f%%\n",
+				opcodeNames[first], opcodeNames[then],
+				(unsigned long long)pairCounts[first][then],
+				share(pairCounts[first][then], totalPairs)
+			);
+		}
+	}
+	
+	void resetOpStats() {
+		std::lock_guard<std::mutex> lock(allStatsMutex);
+		for (auto stats: allStats) {
+			for (auto i = size_t(0); i < nOpcodes; i++) {
+				stats->counts[i].store(0, std::memory_order_relaxed);
+				stats->nTimed[i].store(0, std::memory_order_relaxed);
+				stats->timedTicks[i].store(0, std::memory_order_relaxed);
+				for (auto j = size_t(0); j < nOpcodes; j++) {
+					stats->pairCounts[i][j].store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+}
+
+#endif
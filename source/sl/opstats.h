@@ -0,0 +1,94 @@
+#pragma once
+
+// Counting of the opcodes run, only built with SL_OPCODE_STATS defined
+// (by building with OPCODE_STATS=1), so costs nothing otherwise
+#ifdef SL_OPCODE_STATS
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "func.h"
+
+namespace SL {
+	// opcodeRet is the last opcode
+	static constexpr size_t nOpcodes = size_t(opcodeRet) + 1;
+	
+	// Counts for the ops run on one OS thread. Only that thread writes
+	// them, but they can be read from any thread, for reports.
+	struct OpStats {
+		// Number of times each opcode was run, and each
+		// opcode was run right after each other one
+		std::atomic<uint64_t> counts[nOpcodes];
+		std::atomic<uint64_t> pairCounts[nOpcodes][nOpcodes];
+		
+		// Number of times each opcode was timed, and the total time
+		// taken, in cycles where the timestamp counter can be read
+		std::atomic<uint64_t> nTimed[nOpcodes];
+		std::atomic<uint64_t> timedTicks[nOpcodes];
+	};
+	
+	// Records the ops run by one dispatch loop. Every op is counted,
+	// and one in every sampleInterval timed, from the start of its
+	// dispatch to the start of the next op's. Ops calling native
+	// functions include the time those take.
+	struct OpRecorder {
+		// Prime, so loops of any length have each of their ops timed
+		static constexpr uint32_t sampleInterval = 61;
+		
+		OpStats *stats;
+		int prevOpcode;
+		
+		// Op being timed, if any, and when it started
+		int timedOpcode;
+		uint64_t timedStart;
+		uint32_t nUntilSample;
+		
+		// Ticks between two reads of the time straight after each other
+		uint64_t tickOverhead;
+		
+		void record(int opcode) {
+			if (timedOpcode >= 0) {
+				// Take off the cost of reading the time
+				auto ticks = readTicks() - timedStart;
+				add(stats->nTimed[timedOpcode], 1);
+				add(stats->timedTicks[timedOpcode], ticks > tickOverhead? ticks - tickOverhead : 0);
+				timedOpcode = -1;
+			}
+			
+			add(stats->counts[opcode], 1);
+			if (prevOpcode >= 0) {
+				add(stats->pairCounts[prevOpcode][opcode], 1);
+			}
+			prevOpcode = opcode;
+			
+			if (--nUntilSample == 0) {
+				nUntilSample = sampleInterval;
+				timedOpcode = opcode;
+				timedStart = readTicks();
+			}
+		}
+		
+		void init();
+		
+		// Cycles where the timestamp counter can be read, else nanoseconds
+		static uint64_t readTicks();
+		
+	private:
+		// Only this thread writes, so there's no need for
+		// a locked add
+		static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+			counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+		
+	};
+	
+	// Print the counts for each opcode and the most common pairs,
+	// totalled over every OS thread, from any thread
+	void printOpStats(FILE *stream);
+	// Zero the counts, while no scripts are running
+	void resetOpStats();
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include "output.h"
+
+#include <cassert>
+#include <cstring>
+#include <unistd.h>
+
+#include "number.h"
+#include "val.h"
+
+namespace SL {
+	void Output::makeRoom(size_t nChars) {
+		// Write out only complete lines if that frees enough room, so
+		// outputs sharing a stream (e.g. isolates on other threads)
+		// never split each other's lines
+		auto nLineChars = len;
+		while (nLineChars > 0 && buf[nLineChars - 1] != '\n') {
+			nLineChars--;
+		}
+		if (nLineChars > 0 && bufLen - (len - nLineChars) >= nChars) {
+			fwrite(buf, 1, nLineChars, stream);
+			len -= nLineChars;
+			memmove(buf, buf + nLineChars, len);
+		} else {
+			flush();
+		}
+	}
+	
+	void Output::reserve(size_t nChars) {
+		assert(nChars <= bufLen);
+		if (bufLen - len < nChars) {
+			makeRoom(nChars);
+		}
+	}
+	
+	void Output::flushIfNeeded(bool wroteLf) {
+		if (policy == flushPolicyLine) {
+			if (wroteLf) {
+				flush();
+			}
+		} else if (policy == flushPolicyThreshold) {
+			if (len >= flushThreshold) {
+				flush();
+			}
+		}
+	}
+	
+	void Output::write(size_t nChars, char const *chars) {
+		if (nChars > bufLen - len) {
+			// Write large runs straight through
+			if (nChars > bufLen) {
+				flush();
+				fwrite(chars, 1, nChars, stream);
+				fflush(stream);
+				return;
+			}
+			
+			makeRoom(nChars);
+		}
+		
+		memcpy(buf + len, chars, nChars);
+		len += nChars;
+		
+		flushIfNeeded(policy == flushPolicyLine && memchr(chars, '\n', nChars) != nullptr);
+	}
+	
+	void Output::writeVal(Val val) {
+		// Room for a formatted number or address
+		static constexpr size_t maxValNChars = 40;
+		static_assert(maxValNChars >= maxNumberNChars);
+		
+		if (val.isString()) {
+			auto str = val.stringVal;
+			write(str->nChars, str->getChars());
+			return;
+		}
+		
+		reserve(maxValNChars);
+		
+		auto chars = buf + len;
+		auto nChars = size_t(0);
+		if (val.isNil()) {
+			memcpy(chars, "nil", 3);
+			nChars = 3;
+		} else if (val.isNumber()) {
+			nChars = formatNumber(val.numberVal, chars);
+		} else {
+			char const *typeName;
+			if (val.isArray()) {
+				typeName = "array";
+			} else if (val.isStruct()) {
+				typeName = "struct";
+			} else if (val.isFunc()) {
+				typeName = "func";
+			} else if (val.isThread()) {
+				typeName = "thread";
+			} else if (val.isChannel()) {
+				typeName = "channel";
+			} else {
+				assert(!"unreachable");
+				typeName = "";
+			}
+			
+			auto r = snprintf(chars, maxValNChars, "%s@%p", typeName, val.ptrVal);
+			nChars = (r >= 0)? size_t(r) : 0;
+		}
+		len += nChars;
+		
+		flushIfNeeded(false);
+	}
+	
+	void Output::printVal(Val val) {
+		writeVal(val);
+		
+		reserve(1);
+		buf[len++] = '\n';
+		
+		flushIfNeeded(true);
+	}
+	
+	void Output::flush() {
+		if (len > 0) {
+			fwrite(buf, 1, len, stream);
+			len = 0;
+		}
+		fflush(stream);
+	}
+	
+	void Output::init(FILE *stream, size_t bufLen) {
+		assert(bufLen != 0);
+		this->stream = stream;
+		this->bufLen = bufLen;
+		len = 0;
+		buf = new char[bufLen];
+		
+		policy = isatty(fileno(stream))? flushPolicyLine : flushPolicyExit;
+		flushThreshold = bufLen;
+	}
+	
+	void Output::deinit() {
+		flush();
+		delete[] buf;
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+namespace SL {
+	struct Val;
+	
+	enum FlushPolicy {
+		// Flush only when the buffer is full, when flush() is
+		// called, or on deinit
+		flushPolicyExit,
+		// Also flush after every write containing a line feed
+		flushPolicyLine,
+		// Also flush once flushThreshold bytes are buffered
+		flushPolicyThreshold,
+	};
+	
+	// Buffered writer for script output
+	struct Output {
+		FILE *stream;
+		
+		size_t bufLen, len;
+		char *buf;
+		
+		FlushPolicy policy;
+		size_t flushThreshold;
+		
+		void write(size_t nChars, char const *chars);
+		// Write a value as it would be converted to a string,
+		// without creating the string
+		void writeVal(Val val);
+		// Write a value followed by a line feed
+		void printVal(Val val);
+		
+		void flush();
+		
+		// Defaults to line flushing if the stream is a terminal,
+		// flushing only when full otherwise
+		void init(FILE *stream, size_t bufLen = 64 * 1024);
+		void deinit();
+		
+	private:
+		// Make room for at least nChars more characters
+		void reserve(size_t nChars);
+		void makeRoom(size_t nChars);
+		void flushIfNeeded(bool wroteLf);
+		
+	};
+}
@@ -0,0 +1,194 @@
+#include "profiler.h"
+
+#include <cassert>
+#include <cerrno>
+#include <map>
+#include <string>
+
+#include "func.h"
+#include "funcinfo.h"
+#include "thread.h"
+#include "val.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#define SL_HAS_SIGPROF
+#endif
+
+namespace SL {
+	constinit thread_local Thread *runningThread = nullptr;
+	
+	// Top bit of a sample's frame count, set if
+	// frames further out were left off
+	static constexpr uintptr_t truncatedFlag = ~(~uintptr_t(0) >> 1);
+	
+	// The profiler the signal handler records into, if any, and the number
+	// of handlers running, so stopping can wait for them to finish
+	static std::atomic<Profiler*> activeProfiler = nullptr;
+	static std::atomic<size_t> nRunningHandlers = 0;
+	
+#ifdef SL_HAS_SIGPROF
+	static struct sigaction prevAction;
+#endif
+	
+	void Profiler::onSignal(int) {
+		auto savedErrno = errno;
+		nRunningHandlers.fetch_add(1);
+		
+		auto profiler = activeProfiler.load();
+		if (profiler) {
+			// Everything here must be safe in a signal handler: the thread
+			// interrupted is this one, so its call stack is as it left it,
+			// and reserving space takes no locks
+			auto thread = runningThread;
+			auto nFrames = thread? thread->callStack.len : 0;
+			auto calls = thread? thread->callStack.buf : nullptr;
+			
+			auto header = uintptr_t(nFrames);
+			auto firstFrame = size_t(0);
+			if (nFrames > maxFrames) {
+				firstFrame = nFrames - maxFrames;
+				header = uintptr_t(maxFrames) | truncatedFlag;
+			}
+			auto nWords = 1 + 2 * (nFrames - firstFrame);
+			
+			auto start = profiler->nUsedWords.load(std::memory_order_relaxed);
+			do {
+				if (start + nWords > bufLen) {
+					profiler->nDroppedSamples.fetch_add(1, std::memory_order_relaxed);
+					start = SIZE_MAX;
+					break;
+				}
+			} while (!profiler->nUsedWords.compare_exchange_weak(start, start + nWords, std::memory_order_relaxed));
+			
+			if (start != SIZE_MAX) {
+				auto it = profiler->buf + start;
+				*it++ = header;
+				for (auto i = firstFrame; i < nFrames; i++) {
+					auto func = calls[i].func;
+					*it++ = uintptr_t(func->info);
+					*it++ = uintptr_t(calls[i].opIt - func->ops);
+				}
+				profiler->nSamples.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		
+		nRunningHandlers.fetch_sub(1);
+		errno = savedErrno;
+	}
+	
+	bool Profiler::start(size_t frequency) {
+#ifdef SL_HAS_SIGPROF
+		assert(frequency > 0);
+		
+		Profiler *expected = nullptr;
+		if (!activeProfiler.compare_exchange_strong(expected, this)) {
+			return false;
+		}
+		
+		struct sigaction action = {};
+		action.sa_handler = onSignal;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGPROF, &action, &prevAction);
+		
+		auto usecs = 1000000 / frequency;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		struct itimerval timer = {};
+		timer.it_interval.tv_sec = time_t(usecs / 1000000);
+		timer.it_interval.tv_usec = suseconds_t(usecs % 1000000);
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, nullptr);
+		
+		return true;
+#else
+		return false;
+#endif
+	}
+	
+	void Profiler::stop() {
+#ifdef SL_HAS_SIGPROF
+		if (activeProfiler.load() != this) {
+			return;
+		}
+		
+		struct itimerval timer = {};
+		setitimer(ITIMER_PROF, &timer, nullptr);
+		
+		// Handlers are short, so just spin until any
+		// on other OS threads have finished
+		activeProfiler.store(nullptr);
+		while (nRunningHandlers.load() > 0) {
+		}
+		
+		// Signals sent before the timer stopped may still
+		// arrive, so only put back a handler that ignores them
+		// or handles them itself, not the default of exiting
+		if (prevAction.sa_handler != SIG_DFL) {
+			sigaction(SIGPROF, &prevAction, nullptr);
+		}
+#endif
+	}
+	
+	void Profiler::writeFolded(FILE *stream) {
+		// Sorted, so the same samples always give the same output
+		std::map<std::string, size_t> counts;
+		
+		std::string stack;
+		auto it = buf, end = buf + nUsedWords.load();
+		while (it < end) {
+			auto header = *it++;
+			auto nFrames = size_t(header & ~truncatedFlag);
+			
+			stack.clear();
+			if (header & truncatedFlag) {
+				stack += "[truncated];";
+			} else if (nFrames == 0) {
+				stack += "[outside scripts]";
+			}
+			for (auto i = size_t(0); i < nFrames; i++) {
+				if (i > 0) {
+					stack += ';';
+				}
+				// Calls further out are recorded after the op that made them
+				auto info = uint32_t(it[0]);
+				auto opIdx = size_t(it[1]);
+				if (i < nFrames - 1 && opIdx > 0) {
+					opIdx--;
+				}
+				appendFuncLocation(&stack, info, getFuncInfo(info)->getLine(opIdx));
+				it += 2;
+			}
+			counts[stack]++;
+		}
+		
+		for (auto &[stack, count]: counts) {
+			fprintf(stream, "%s %zu\n", stack.c_str(), count);
+		}
+	}
+	
+	size_t Profiler::getNSamples() const {
+		return nSamples.load(std::memory_order_relaxed);
+	}
+	
+	size_t Profiler::getNDroppedSamples() const {
+		return nDroppedSamples.load(std::memory_order_relaxed);
+	}
+	
+	void Profiler::init() {
+		// Pages are only touched once samples are written to them
+		buf = new uintptr_t[bufLen];
+		nUsedWords = 0;
+		nSamples = 0;
+		nDroppedSamples = 0;
+	}
+	
+	void Profiler::deinit() {
+		stop();
+		delete[] buf;
+		buf = nullptr;
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace SL {
+	struct Thread;
+	
+	// Thread whose ops are being run on this OS thread, if any, for the
+	// profiler to sample. Set while the thread runs, then put back to
+	// whichever thread ran before, for coroutines and calls back into
+	// the VM from native functions.
+	extern constinit thread_local Thread *runningThread;
+	
+	struct RunningThreadScope {
+		Thread *prevThread;
+		
+		explicit RunningThreadScope(Thread *thread): prevThread(runningThread) {
+			runningThread = thread;
+			std::atomic_signal_fence(std::memory_order_release);
+		}
+		
+		~RunningThreadScope() {
+			std::atomic_signal_fence(std::memory_order_release);
+			runningThread = prevThread;
+		}
+	};
+	
+	// Sampling profiler for scripts. While started, SIGPROF interrupts
+	// whichever OS thread is using CPU, at a frequency of CPU time, and
+	// the call stack of the thread running there is recorded. Calls
+	// made by the top function are recorded at the ops they were made
+	// from, while the top function itself is recorded at the start of
+	// the run of ops it's in, as the op being run is only kept in a
+	// register. Time in native functions counts towards the function
+	// that called them, and a coroutine's stack starts at its entry
+	// function. Only supported where setitimer is.
+	struct Profiler {
+		// Words of samples recorded before any more are dropped, enough
+		// for some minutes of samples at 1 kHz
+		static constexpr size_t bufLen = size_t(1) << 22;
+		// Frames recorded per sample, counting from the top
+		static constexpr size_t maxFrames = 128;
+		
+		// Start sampling, frequency times a second. Only one profiler
+		// can be running at once. Returns false, sampling nothing, if
+		// one already is or the platform has no SIGPROF.
+		bool start(size_t frequency);
+		// Stop sampling, waiting for any samples being recorded
+		void stop();
+		
+		// Write the samples recorded so far, while stopped, as folded
+		// stacks for flame graph tools: a line for each distinct stack,
+		// with its frames from the outermost in, separated by semicolons,
+		// then the number of times it was sampled
+		void writeFolded(FILE *stream);
+		
+		size_t getNSamples() const;
+		size_t getNDroppedSamples() const;
+		
+		void init();
+		void deinit();
+		
+	private:
+		// Samples, each the number of frames, then the function info
+		// (see funcinfo.h) and op index of each frame from the outermost
+		// in. Functions may be freed before the samples are written.
+		uintptr_t *buf;
+		std::atomic<size_t> nUsedWords;
+		std::atomic<size_t> nSamples;
+		std::atomic<size_t> nDroppedSamples;
+		
+		static void onSignal(int signal);
+		
+	};
+}
@@ -0,0 +1,328 @@
+#include "scheduler.h"
+
+#include <cassert>
+
+#include "array.h"
+#include "channel.h"
+#include "thread.h"
+
+namespace SL {
+	// Worker running on the calling OS thread, if any
+	thread_local static Worker *currentWorker = nullptr;
+	
+	// Retry the channel operation a task is waiting on, giving the value
+	// to resume it with if it is done. The operation is also done if the
+	// channel was closed, in which case it fails.
+	static bool retryWait(Task *task, Val *oResumeVal) {
+		auto ch = task->waitChannel;
+		if (task->isWaitingToSend) {
+			if (ch->trySend(task->waitVal)) {
+				*oResumeVal = Val::fromBool(true);
+			} else if (ch->isClosed.load(std::memory_order_acquire)) {
+				// Take back what wasn't sent
+				task->heap.adopt(task->waitVal);
+				*oResumeVal = Val::fromBool(false);
+			} else {
+				return false;
+			}
+		} else {
+			if (!ch->tryReceive(oResumeVal)) {
+				if (!ch->isClosed.load(std::memory_order_acquire)) {
+					return false;
+				}
+				// Check for values sent before closing once more
+				if (!ch->tryReceive(oResumeVal)) {
+					*oResumeVal = Val::newNil();
+				}
+			}
+			task->heap.adopt(*oResumeVal);
+		}
+		
+		task->waitChannel = nullptr;
+		task->waitVal = Val::newNil();
+		return true;
+	}
+	
+	bool Scheduler::runTaskSlice(Task *task, Output *output) {
+		auto resumeVal = Val::newNil();
+		if (task->waitChannel && !retryWait(task, &resumeVal)) {
+			return false;
+		}
+		
+		auto thread = task->thread;
+		thread->output = output;
+		thread->fuel = sliceFuel;
+		
+		Val result;
+		auto ok = thread->resume(resumeVal, &result);
+		if (thread->state == threadStateSuspended) {
+			return false;
+		}
+		
+		task->ok = ok;
+		task->result = result;
+		thread->deinit();
+		task->isDone.store(true, std::memory_order_release);
+		return true;
+	}
+	
+	void Scheduler::runTask(Task *task, Output *output) {
+		while (!runTaskSlice(task, output)) {
+			std::this_thread::yield();
+		}
+	}
+	
+	Task *Scheduler::find(Worker *worker) {
+		Task *task = nullptr;
+		
+		if (worker) {
+			task = worker->deque.take();
+		}
+		
+		if (!task) {
+			std::lock_guard<std::mutex> lock(injectedMutex);
+			if (injectedHead < injected.len) {
+				task = injected.buf[injectedHead++];
+				if (injectedHead == injected.len) {
+					injectedHead = 0;
+					injected.len = 0;
+				}
+			}
+		}
+		
+		if (!task) {
+			// Start with the next worker along, so thieves
+			// spread out over their victims
+			auto firstIdx = worker? worker->idx + 1 : size_t(0);
+			for (auto i = size_t(0); i < nWorkers && !task; i++) {
+				auto victim = &workers[(firstIdx + i) % nWorkers];
+				if (victim == worker) {
+					continue;
+				}
+				
+				task = victim->deque.steal();
+				if (task && worker) {
+					worker->nSteals.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		}
+		
+		if (task) {
+			nQueued.fetch_sub(1);
+		}
+		return task;
+	}
+	
+	void Scheduler::runFound(Task *task, Worker *worker, Output *output) {
+		if (!runTaskSlice(task, worker? &worker->output : output)) {
+			// Give whatever the task is waiting on a chance to happen
+			// before it comes round again. Once queued, it may already
+			// be running elsewhere, so is looked at first.
+			auto isWaiting = task->waitChannel != nullptr;
+			enqueue(task, true);
+			if (isWaiting) {
+				std::this_thread::yield();
+			}
+			return;
+		}
+		
+		if (worker) {
+			worker->nTasksRun.fetch_add(1, std::memory_order_relaxed);
+		}
+		
+		// The task may be the one someone is waiting for. The fence
+		// orders the task being marked done before the check, so that
+		// either the waiter sees it done or it's seen waiting.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (nJoining.load() > 0) {
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+			}
+			joinCond.notify_all();
+		}
+	}
+	
+	void Scheduler::workerMain(Worker *worker) {
+		currentWorker = worker;
+		
+		for (;;) {
+			auto task = find(worker);
+			if (task) {
+				auto startTime = std::chrono::steady_clock::now();
+				runFound(task, worker, nullptr);
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - startTime
+				).count();
+				worker->busyNs.fetch_add(int64_t(ns), std::memory_order_relaxed);
+				continue;
+			}
+			
+			// Out of work, so show what has been printed
+			// before going to sleep
+			worker->output.flush();
+			
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			nSleeping.fetch_add(1);
+			while (nQueued.load() == 0 && !isStopping.load()) {
+				sleepCond.wait(lock);
+			}
+			nSleeping.fetch_sub(1);
+			
+			if (nQueued.load() == 0 && isStopping.load()) {
+				break;
+			}
+		}
+		
+		currentWorker = nullptr;
+	}
+	
+	void Scheduler::start() {
+		startTime = std::chrono::steady_clock::now();
+		for (auto i = size_t(0); i < nWorkers; i++) {
+			auto worker = &workers[i];
+			worker->osThread = std::thread([this, worker]() {
+				workerMain(worker);
+			});
+		}
+		isStarted = true;
+	}
+	
+	void Scheduler::spawn(Task *task) {
+		std::call_once(startFlag, [this]() {
+			start();
+		});
+		
+		enqueue(task, false);
+	}
+	
+	void Scheduler::enqueue(Task *task, bool isWaiting) {
+		// Counted before being queued, so a worker finding
+		// it never sees the count go below 0
+		nQueued.fetch_add(1);
+		
+		// Waiting tasks go to the back of the shared queue,
+		// so everything else gets a turn before they are retried
+		if (!isWaiting && currentWorker && currentWorker->scheduler == this) {
+			currentWorker->deque.push(task);
+		} else {
+			std::lock_guard<std::mutex> lock(injectedMutex);
+			injected.push(task);
+		}
+		
+		// Taking the lock makes sure a worker that saw no tasks
+		// is waiting by the time it is notified. Threads waiting
+		// on tasks are woken as well, to help.
+		auto nSleepers = nSleeping.load(), nJoiners = nJoining.load();
+		if (nSleepers > 0 || nJoiners > 0) {
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+			}
+			if (nSleepers > 0) {
+				sleepCond.notify_one();
+			}
+			if (nJoiners > 0) {
+				joinCond.notify_all();
+			}
+		}
+	}
+	
+	void Scheduler::wait(Task *task, Output *output) {
+		auto worker = (currentWorker && currentWorker->scheduler == this)? currentWorker : nullptr;
+		
+		// Help out rather than block, so tasks waiting on tasks they
+		// spawned always make progress, even with every worker waiting.
+		// Only with nothing to help with, sleep until the task finishes
+		// or more work turns up.
+		while (!task->isDone.load(std::memory_order_acquire)) {
+			auto other = find(worker);
+			if (other) {
+				runFound(other, worker, output);
+				continue;
+			}
+			
+			auto sleepStartTime = std::chrono::steady_clock::now();
+			{
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				nJoining.fetch_add(1);
+				while (!task->isDone.load() && nQueued.load() == 0) {
+					joinCond.wait(lock);
+				}
+				nJoining.fetch_sub(1);
+			}
+			
+			// A worker is counted busy while running the task that's
+			// waiting, so take off the time spent asleep
+			if (worker) {
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - sleepStartTime
+				).count();
+				worker->busyNs.fetch_sub(int64_t(ns), std::memory_order_relaxed);
+			}
+		}
+	}
+	
+	void Scheduler::printStats(FILE *stream) {
+		auto secs = isStarted?
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() :
+			0.0;
+			
+		fprintf(stream, "worker  tasks     steals    busy\n");
+		for (auto i = size_t(0); i < nWorkers; i++) {
+			auto worker = &workers[i];
+			auto busySecs = double(worker->busyNs.load(std::memory_order_relaxed)) * 1e-9;
+			fprintf(stream, "%-7zu %-9zu %-9zu %5.1f%%\n",
+				i,
+				worker->nTasksRun.load(std::memory_order_relaxed),
+				worker->nSteals.load(std::memory_order_relaxed),
+				(secs > 0.0)? 100.0 * busySecs / secs : 0.0
+			);
+		}
+	}
+	
+	void Scheduler::init(size_t nWorkers) {
+		assert(nWorkers > 0);
+		this->nWorkers = nWorkers;
+		
+		workers = new Worker[nWorkers];
+		for (auto i = size_t(0); i < nWorkers; i++) {
+			auto worker = &workers[i];
+			worker->scheduler = this;
+			worker->idx = i;
+			worker->deque.init();
+			worker->output.init(stdout);
+			worker->nTasksRun.store(0, std::memory_order_relaxed);
+			worker->nSteals.store(0, std::memory_order_relaxed);
+			worker->busyNs.store(0, std::memory_order_relaxed);
+		}
+		
+		isStarted = false;
+		injected.init(64);
+		injectedHead = 0;
+		nQueued.store(0);
+		nSleeping.store(0);
+		nJoining.store(0);
+		isStopping.store(false);
+	}
+	
+	void Scheduler::deinit() {
+		// Let the workers run out of tasks and exit
+		if (isStarted) {
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+				isStopping.store(true);
+			}
+			sleepCond.notify_all();
+			
+			for (auto i = size_t(0); i < nWorkers; i++) {
+				workers[i].osThread.join();
+			}
+		}
+		
+		for (auto i = size_t(0); i < nWorkers; i++) {
+			workers[i].output.deinit();
+			workers[i].deque.deinit();
+		}
+		delete[] workers;
+		injected.deinit();
+	}
+}
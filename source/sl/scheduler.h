@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "darray.h"
+#include "deque.h"
+#include "heap.h"
+#include "output.h"
+#include "val.h"
+
+namespace SL {
+	struct Channel;
+	struct Thread;
+	struct Scheduler;
+	
+	// Function spawned to run in parallel with its spawner. A task has a
+	// heap of its own and runs on a thread of its own, so shares nothing
+	// mutable with its spawner: arguments are copied in on spawn, and
+	// the result is copied out on join.
+	//
+	// A task waiting on a channel is suspended and put back in the
+	// queue, rather than holding on to the OS thread running it. The
+	// channel operation is retried before resuming it. Tasks are also
+	// suspended and put back once they've used up a slice of fuel, so
+	// long ones don't keep those queued behind them from running.
+	struct Task {
+		Heap heap;
+		
+		// Thread the task runs on, which is also
+		// its handle in the spawner
+		Thread *thread;
+		
+		// Channel the task is waiting to send waitVal to,
+		// or to receive from, if any
+		Channel *waitChannel;
+		bool isWaitingToSend;
+		Val waitVal;
+		
+		bool ok;
+		Val result;
+		std::atomic<bool> isDone;
+	};
+	
+	struct Worker {
+		Scheduler *scheduler;
+		size_t idx;
+		WorkDeque<Task*> deque;
+		
+		// Destination of print statements in tasks run by this worker
+		Output output;
+		
+		std::thread osThread;
+		
+		// Statistics, only written by the worker itself
+		std::atomic<size_t> nTasksRun, nSteals;
+		std::atomic<int64_t> busyNs;
+	};
+	
+	// Runs tasks on a fixed pool of OS threads, started on first spawn.
+	// Tasks spawned by a worker go on its own deque, others on a shared
+	// queue, and workers out of tasks steal from each other.
+	struct Scheduler {
+		// Fuel (see Thread::fuel) a task can burn each time it runs,
+		// enough for about a millisecond
+		static constexpr size_t sliceFuel = size_t(1) << 16;
+		
+		size_t nWorkers;
+		Worker *workers;
+		
+		void spawn(Task *task);
+		// Run other tasks until task is done. Tasks run while waiting on
+		// a thread outside the pool print to output.
+		void wait(Task *task, Output *output);
+		
+		// Print the tasks run, steals, and share of time spent running
+		// tasks of each worker
+		void printStats(FILE *stream);
+		
+		// Run a task to completion on the calling thread
+		static void runTask(Task *task, Output *output);
+		// Run a task until it finishes, has to wait, or has used up
+		// its slice of fuel, returning whether it finished
+		static bool runTaskSlice(Task *task, Output *output);
+		
+		void init(size_t nWorkers);
+		void deinit();
+		
+	private:
+		std::once_flag startFlag;
+		bool isStarted;
+		std::chrono::steady_clock::time_point startTime;
+		
+		// Tasks spawned from outside the pool, and ones
+		// waiting on channels, run in order
+		std::mutex injectedMutex;
+		DArray<Task*> injected;
+		size_t injectedHead;
+		
+		// Number of tasks queued but not yet picked up, and
+		// of workers asleep waiting for them
+		std::atomic<size_t> nQueued, nSleeping;
+		std::mutex sleepMutex;
+		std::condition_variable sleepCond;
+		// Threads in wait with nothing to help with, asleep until
+		// a task finishes or another is queued
+		std::atomic<size_t> nJoining;
+		std::condition_variable joinCond;
+		std::atomic<bool> isStopping;
+		
+		// Find a task to run, from worker's deque if the calling
+		// thread is a worker (so worker isn't null), then the
+		// shared queue, then the other workers' deques
+		Task *find(Worker *worker);
+		void runFound(Task *task, Worker *worker, Output *output);
+		
+		// Queue a new task, or one that had to wait or ran
+		// out of fuel
+		void enqueue(Task *task, bool isWaiting);
+		
+		void start();
+		void workerMain(Worker *worker);
+		
+	};
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+namespace SL {
+	// Pattern-defeating quicksort (introsort with insertion sort for
+	// small ranges, partition-based detection of sorted and equal runs,
+	// and a heapsort fallback after too many unbalanced partitions).
+	//
+	// Every loop is bounds checked rather than relying on sentinels, so
+	// an inconsistent comparator (e.g. one written in script) produces
+	// an unspecified order but never reads outside [first, last).
+	template <typename T, typename Less>
+	struct Sorter {
+		Less less;
+		
+		static constexpr ptrdiff_t insertionSortThreshold = 24;
+		static constexpr ptrdiff_t nintherThreshold = 128;
+		static constexpr size_t partialInsertionSortLimit = 8;
+		
+		void insertionSort(T *first, T *last) {
+			if (first == last) {
+				return;
+			}
+			for (auto it = first + 1; it < last; it++) {
+				auto v = std::move(*it);
+				auto j = it;
+				while (j > first && less(v, j[-1])) {
+					*j = std::move(j[-1]);
+					j--;
+				}
+				*j = std::move(v);
+			}
+		}
+		
+		// Insertion sort that gives up (returning false) once more
+		// than a few elements have had to be moved
+		bool partialInsertionSort(T *first, T *last) {
+			if (first == last) {
+				return true;
+			}
+			
+			auto nMoved = size_t(0);
+			for (auto it = first + 1; it < last; it++) {
+				auto v = std::move(*it);
+				auto j = it;
+				while (j > first && less(v, j[-1])) {
+					*j = std::move(j[-1]);
+					j--;
+				}
+				*j = std::move(v);
+				
+				nMoved += size_t(it - j);
+				if (nMoved > partialInsertionSortLimit) {
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		void siftDown(T *first, ptrdiff_t len, ptrdiff_t i) {
+			for (;;) {
+				auto child = 2*i + 1;
+				if (child >= len) {
+					break;
+				}
+				if (child + 1 < len && less(first[child], first[child + 1])) {
+					child++;
+				}
+				if (!less(first[i], first[child])) {
+					break;
+				}
+				std::swap(first[i], first[child]);
+				i = child;
+			}
+		}
+		
+		void heapSort(T *first, T *last) {
+			auto len = last - first;
+			for (auto i = len/2; i-- > 0;) {
+				siftDown(first, len, i);
+			}
+			for (auto i = len; i-- > 1;) {
+				std::swap(first[0], first[i]);
+				siftDown(first, i, 0);
+			}
+		}
+		
+		// Order *a, *b, *c ascending
+		void sort3(T *a, T *b, T *c) {
+			if (less(*b, *a)) {
+				std::swap(*a, *b);
+			}
+			if (less(*c, *b)) {
+				std::swap(*b, *c);
+			}
+			if (less(*b, *a)) {
+				std::swap(*a, *b);
+			}
+		}
+		
+		// Partition around the pivot *first, elements equal to the
+		// pivot going to the right. Returns the final position of the
+		// pivot, and whether no elements had to be swapped.
+		T *partitionRight(T *first, T *last, bool *oAlreadyPartitioned) {
+			auto pivot = std::move(*first);
+			auto i = first + 1, j = last - 1;
+			
+			while (i <= j && less(*i, pivot)) {
+				i++;
+			}
+			while (i <= j && !less(*j, pivot)) {
+				j--;
+			}
+			*oAlreadyPartitioned = i > j;
+			
+			while (i < j) {
+				std::swap(*i, *j);
+				i++;
+				j--;
+				while (i <= j && less(*i, pivot)) {
+					i++;
+				}
+				while (i <= j && !less(*j, pivot)) {
+					j--;
+				}
+			}
+			
+			auto pivotPos = i - 1;
+			*first = std::move(*pivotPos);
+			*pivotPos = std::move(pivot);
+			return pivotPos;
+		}
+		
+		// Partition around the pivot *first, elements equal to the
+		// pivot going to the left. Used when the pivot equals the
+		// element preceding the range, in which case everything that
+		// lands left of it is equal to it and needs no further sorting.
+		T *partitionLeft(T *first, T *last) {
+			auto pivot = std::move(*first);
+			auto i = first + 1, j = last - 1;
+			
+			while (i <= j && less(pivot, *j)) {
+				j--;
+			}
+			while (i <= j && !less(pivot, *i)) {
+				i++;
+			}
+			
+			while (i < j) {
+				std::swap(*i, *j);
+				i++;
+				j--;
+				while (i <= j && less(pivot, *j)) {
+					j--;
+				}
+				while (i <= j && !less(pivot, *i)) {
+					i++;
+				}
+			}
+			
+			*first = std::move(*j);
+			*j = std::move(pivot);
+			return j;
+		}
+		
+		void sortLoop(T *first, T *last, size_t nBadAllowed, bool isLeftmost) {
+			for (;;) {
+				auto len = last - first;
+				if (len <= insertionSortThreshold) {
+					insertionSort(first, last);
+					return;
+				}
+				
+				// Move the median of 3 (or of 3 medians of 3 for larger
+				// ranges) to the start of the range to use as the pivot
+				auto half = len/2;
+				if (len > nintherThreshold) {
+					sort3(first, first + half, last - 1);
+					sort3(first + 1, first + (half - 1), last - 2);
+					sort3(first + 2, first + (half + 1), last - 3);
+					sort3(first + (half - 1), first + half, first + (half + 1));
+					std::swap(*first, first[half]);
+				} else {
+					sort3(first + half, first, last - 1);
+				}
+				
+				// If the pivot is equal to the preceding element,
+				// gather everything equal to it on the left and skip it
+				if (!isLeftmost && !less(first[-1], *first)) {
+					first = partitionLeft(first, last) + 1;
+					continue;
+				}
+				
+				bool alreadyPartitioned;
+				auto pivotPos = partitionRight(first, last, &alreadyPartitioned);
+				
+				auto leftLen = pivotPos - first;
+				auto rightLen = last - (pivotPos + 1);
+				if (leftLen < len/8 || rightLen < len/8) {
+					// Too many unbalanced partitions means the input is
+					// adversarial for this pivot selection, so fall back
+					// to guaranteed O(n log n)
+					if (nBadAllowed-- == 0) {
+						heapSort(first, last);
+						return;
+					}
+					
+					// Break up patterns that caused the bad partition
+					if (leftLen >= insertionSortThreshold) {
+						std::swap(first[0], first[leftLen/4]);
+						std::swap(pivotPos[-1], pivotPos[-leftLen/4]);
+					}
+					if (rightLen >= insertionSortThreshold) {
+						std::swap(pivotPos[1], pivotPos[1 + rightLen/4]);
+						std::swap(last[-1], last[-rightLen/4]);
+					}
+				} else if (alreadyPartitioned &&
+					partialInsertionSort(first, pivotPos) &&
+					partialInsertionSort(pivotPos + 1, last)
+				) {
+					// Input was (nearly) sorted already
+					return;
+				}
+				
+				// Recurse into the smaller side and loop on the larger
+				// one to bound the stack depth
+				if (leftLen < rightLen) {
+					sortLoop(first, pivotPos, nBadAllowed, isLeftmost);
+					first = pivotPos + 1;
+					isLeftmost = false;
+				} else {
+					sortLoop(pivotPos + 1, last, nBadAllowed, false);
+					last = pivotPos;
+				}
+			}
+		}
+	};
+	
+	template <typename T, typename Less>
+	void sort(T *first, T *last, Less less) {
+		auto nBadAllowed = size_t(0);
+		for (auto len = size_t(last - first); len > 1; len >>= 1) {
+			nBadAllowed++;
+		}
+		
+		Sorter<T, Less>{less}.sortLoop(first, last, nBadAllowed, true);
+	}
+}
@@ -1,101 +1,314 @@
 #include "struct.h"
 
-#include "string.h"
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "allocstats.h"
 
 namespace SL {
-	void Struct::expand(size_t newNEntries) {
-		auto newEntries = new Entry[newNEntries];
-		for (auto i = size_t(0); i < newNEntries; i++) {
-			newEntries[i].state = entryStateEmpty;
-		}
-		
-		auto newLoad = size_t(0);
-		for (auto i = size_t(0); i < nEntries; i++) {
-			auto entry = &entries[i];
-			if (entry->state == entryStateOccupied) {
-				newLoad++;
-				auto idx = entry->key->hash() & (newNEntries - 1);
-				for (;;) {
-					auto newEntry = &newEntries[idx];
-					if (newEntry->state == entryStateEmpty) {
-						newEntry->state = entryStateOccupied;
-						newEntry->key = entry->key;
-						newEntry->val = entry->val;
-						break;
-					}
-					idx = (idx + 1) & (newNEntries - 1);
-				}
+	// Bitmask with a bit set for each slot in a group
+	// whose control byte matches
+	using GroupMatch = uint32_t;
+	
+	static GroupMatch groupMatchByte(int8_t const *group, int8_t b) {
+#ifdef __SSE2__
+		auto g = _mm_loadu_si128((__m128i const*)group);
+		return GroupMatch(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b))));
+#else
+		auto r = GroupMatch(0);
+		for (auto i = size_t(0); i < Struct::groupSize; i++) {
+			r |= GroupMatch(group[i] == b) << i;
+		}
+		return r;
+#endif
+	}
+	
+	static GroupMatch groupMatchEmptyOrDeleted(int8_t const *group) {
+#ifdef __SSE2__
+		auto g = _mm_loadu_si128((__m128i const*)group);
+		return GroupMatch(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), g)));
+#else
+		auto r = GroupMatch(0);
+		for (auto i = size_t(0); i < Struct::groupSize; i++) {
+			r |= GroupMatch(group[i] < -1) << i;
+		}
+		return r;
+#endif
+	}
+	
+	static size_t groupMatchFirst(GroupMatch m) {
+		assert(m != 0);
+		return size_t(std::countr_zero(m));
+	}
+	
+	// Number of keys a table can hold before it is considered full
+	static size_t maxLoad(size_t nSlots) {
+		return nSlots - nSlots / 8;
+	}
+	
+	static int8_t hashCtrl(uint32_t hash) {
+		return int8_t(hash & 0x7f);
+	}
+	
+	// Groups are visited in triangular steps starting from one picked
+	// by the hash bits not used for control bytes. As the number of
+	// groups is a power of 2, every group is visited eventually.
+	struct ProbeSeq {
+		size_t slotMask, offset, step;
+		
+		ProbeSeq(uint32_t hash, size_t nSlots):
+			slotMask(nSlots - 1),
+			offset((size_t(hash >> 7) * Struct::groupSize) & slotMask),
+			step(0) { }
+		
+		void next() {
+			step += Struct::groupSize;
+			offset = (offset + step) & slotMask;
+		}
+	};
+	
+	size_t Struct::findInsertSlot(uint32_t hash) {
+		for (auto seq = ProbeSeq(hash, nSlots);; seq.next()) {
+			auto m = groupMatchEmptyOrDeleted(ctrl + seq.offset);
+			if (m != 0) {
+				return seq.offset + groupMatchFirst(m);
+			}
+		}
+	}
+	
+	void Struct::allocSlots(size_t nSlots) {
+		assert(nSlots >= groupSize && (nSlots & (nSlots - 1)) == 0);
+		
+		this->nSlots = nSlots;
+		setSlotsBuf(new char[getSlotsSize(nSlots)]);
+		trackBufferAlloc(objectTypeStruct, getSlotsSize(nSlots));
+		
+		memset(ctrl, ctrlEmpty, nSlots);
+		growthLeft = maxLoad(nSlots) - nKeys;
+	}
+	
+	void Struct::rehash(size_t newNSlots) {
+		auto oldNSlots = nSlots;
+		auto oldBuf = (char*)keys;
+		auto isOldBufInline = hasInlineSlots();
+		auto oldCtrl = ctrl;
+		auto oldKeys = keys;
+		auto oldVals = vals;
+		
+		reserveRunningHeapBytes(getSlotsSize(newNSlots));
+		allocSlots(newNSlots);
+		
+		for (auto i = size_t(0); i < oldNSlots; i++) {
+			if (oldCtrl[i] >= 0) {
+				auto hash = oldKeys[i]->hash();
+				auto slot = findInsertSlot(hash);
+				ctrl[slot] = hashCtrl(hash);
+				keys[slot] = oldKeys[i];
+				vals[slot] = oldVals[i];
 			}
 		}
 		
-		delete[] entries;
+		if (!isOldBufInline) {
+			delete[] oldBuf;
+		}
+	}
+	
+	void Struct::rehashInPlace() {
+		// Mark every occupied slot as deleted and every deleted one as
+		// empty. Occupied slots still to be placed are then exactly those
+		// marked deleted.
+		for (auto i = size_t(0); i < nSlots; i++) {
+			ctrl[i] = (ctrl[i] >= 0)? int8_t(ctrlDeleted) : int8_t(ctrlEmpty);
+		}
+		
+		for (auto i = size_t(0); i < nSlots; i++) {
+			if (ctrl[i] != ctrlDeleted) {
+				continue;
+			}
+			
+			auto hash = keys[i]->hash();
+			auto slot = findInsertSlot(hash);
+			
+			// The slot's own group is always found at the latest, as the
+			// slot is marked deleted. If that's where it would go anyway,
+			// leave it in place.
+			if (slot / groupSize == i / groupSize) {
+				ctrl[i] = hashCtrl(hash);
+				continue;
+			}
+			
+			if (ctrl[slot] == ctrlEmpty) {
+				ctrl[slot] = hashCtrl(hash);
+				keys[slot] = keys[i];
+				vals[slot] = vals[i];
+				ctrl[i] = ctrlEmpty;
+			} else {
+				// The target holds another key still to be placed,
+				// swap with it and place that key next
+				ctrl[slot] = hashCtrl(hash);
+				std::swap(keys[slot], keys[i]);
+				std::swap(vals[slot], vals[i]);
+				i--;
+			}
+		}
 		
-		nEntries = newNEntries;
-		entries = newEntries;
-		load = newLoad;
+		growthLeft = maxLoad(nSlots) - nKeys;
 	}
 	
-	Struct::Entry *Struct::find(String *key) {
-		auto idx = key->hash() & (nEntries - 1);
-		auto tombstoneIdx = SIZE_MAX;
-		for (;;) {
-			auto entry = &entries[idx];
-			if (entry->state == entryStateTombstone) {
-				tombstoneIdx = idx;
-			} else if (entry->state == entryStateEmpty) {
-				if (tombstoneIdx != SIZE_MAX) {
-					return &entries[tombstoneIdx];
-				} else {
-					return entry;
+	size_t Struct::find(String *key) {
+		auto hash = key->hash();
+		auto c = hashCtrl(hash);
+		for (auto seq = ProbeSeq(hash, nSlots);; seq.next()) {
+			auto group = ctrl + seq.offset;
+			for (auto m = groupMatchByte(group, c); m != 0; m &= m - 1) {
+				auto slot = seq.offset + groupMatchFirst(m);
+				if (keys[slot]->isEqual(key)) {
+					return slot;
 				}
-			} else if (entry->state == entryStateOccupied &&
-				entry->key->isEqual(key)) {
-				
-				return entry;
 			}
 			
-			idx = (idx + 1) & (nEntries - 1);
+			// Keys are never placed beyond a group with an empty slot
+			if (groupMatchByte(group, ctrlEmpty) != 0) {
+				return SIZE_MAX;
+			}
 		}
 	}
 	
 	bool Struct::get(String *key, Val *oVal) {
-		auto entry = find(key);
-		if (entry->state == entryStateOccupied) {
-			*oVal = entry->val;
+		auto slot = find(key);
+		if (slot != SIZE_MAX) {
+			*oVal = vals[slot];
 			return true;
 		} else {
 			return false;
 		}
 	}
 	
-	void Struct::set(String *key, Val val) {
-		// If load > (nEntries * 0.6875)
-		if (load > (nEntries / 2) + (nEntries / 8) + (nEntries / 16)) {
-			expand(nEntries * 2);
+	bool Struct::set(String *key, Val val) {
+		if (isFrozen) {
+			return false;
 		}
 		
-		auto entry = find(key);
-		if (entry->state != entryStateOccupied) {
-			entry->state = entryStateOccupied;
-			entry->key = key;
-			load++;
+		auto slot = find(key);
+		if (slot != SIZE_MAX) {
+			vals[slot] = val;
+			return true;
 		}
-		entry->val = val;
+		
+		auto hash = key->hash();
+		slot = findInsertSlot(hash);
+		
+		if (growthLeft == 0 && ctrl[slot] == ctrlEmpty) {
+			// If tombstones make up much of the table, reclaim them,
+			// otherwise grow
+			if (nKeys < maxLoad(nSlots) / 2) {
+				rehashInPlace();
+			} else {
+				rehash(nSlots * 2);
+			}
+			slot = findInsertSlot(hash);
+		}
+		
+		if (ctrl[slot] == ctrlEmpty) {
+			growthLeft--;
+		}
+		
+		ctrl[slot] = hashCtrl(hash);
+		keys[slot] = key;
+		vals[slot] = val;
+		nKeys++;
+		keysVersion++;
+		
+		return true;
 	}
 	
-	void Struct::remove(String *key) {
-		auto entry = find(key);
-		entry->state = entryStateTombstone;
+	bool Struct::remove(String *key) {
+		if (isFrozen) {
+			return false;
+		}
+		
+		auto slot = find(key);
+		if (slot == SIZE_MAX) {
+			return true;
+		}
+		
+		nKeys--;
+		keysVersion++;
+		
+		// A probe only continues past a group with no empty slots, so
+		// if this group has one, no probe can need this slot as a
+		// tombstone and it can be freed for reuse straight away
+		auto group = ctrl + (slot & ~(groupSize - 1));
+		if (groupMatchByte(group, ctrlEmpty) != 0) {
+			ctrl[slot] = ctrlEmpty;
+			growthLeft++;
+		} else {
+			ctrl[slot] = ctrlDeleted;
+		}
+		
+		return true;
+	}
+	
+	Struct::ProbeStats Struct::getProbeStats() {
+		auto r = ProbeStats{};
+		for (auto i = size_t(0); i < nSlots; i++) {
+			if (!slotIsOccupied(i)) {
+				continue;
+			}
+			
+			auto probeLen = size_t(0);
+			for (auto seq = ProbeSeq(keys[i]->hash(), nSlots);
+				seq.offset != (i & ~(groupSize - 1));
+				seq.next()
+			) {
+				probeLen++;
+			}
+			
+			r.nKeys++;
+			r.totalProbeLen += probeLen;
+			if (probeLen > r.maxProbeLen) {
+				r.maxProbeLen = probeLen;
+			}
+		}
+		return r;
+	}
+	
+	Struct *Struct::create(Heap *heap, size_t nKeys) {
+		auto nSlots = groupSize;
+		while (maxLoad(nSlots) < nKeys) {
+			nSlots *= 2;
+		}
+		
+		// Count the slots before there's a struct to leave without any
+		heap->reserveBytes(getSlotsSize(nSlots));
+		auto r = (Struct*)heap->createObject(sizeof(Struct), objectTypeStruct);
+		r->nKeys = 0;
+		r->allocSlots(nSlots);
+		r->keysVersion = 0;
+		
+		return r;
 	}
 	
-	Struct *Struct::create(Heap *heap, size_t nEntries) {
+	Struct *Struct::createFromTemplate(Heap *heap, Struct *tmpl, Val const *vals) {
+		heap->reserveBytes(getSlotsSize(tmpl->nSlots));
 		auto r = (Struct*)heap->createObject(sizeof(Struct), objectTypeStruct);
-		r->nEntries = nEntries;
-		r->entries = new Entry[nEntries];
-		r->load = 0;
+		r->nKeys = tmpl->nKeys;
+		r->allocSlots(tmpl->nSlots);
+		r->growthLeft = tmpl->growthLeft;
+		r->keysVersion = 0;
 		
-		for (auto i = size_t(0); i < nEntries; i++) {
-			r->entries[i].state = entryStateEmpty;
+		memcpy(r->ctrl, tmpl->ctrl, tmpl->nSlots);
+		memcpy(r->keys, tmpl->keys, sizeof(String*) * tmpl->nSlots);
+		for (auto i = size_t(0); i < tmpl->nSlots; i++) {
+			if (tmpl->slotIsOccupied(i)) {
+				r->vals[i] = vals[size_t(tmpl->vals[i].numberVal)];
+			}
 		}
 		
 		return r;
@@ -1,37 +1,103 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 #include "heap.h"
 #include "val.h"
 
 namespace SL {
 	struct String;
 	
+	// Hash table from strings to values, laid out as a Swiss table.
+	// Each slot has a control byte saying whether it is empty, deleted
+	// (a tombstone), or occupied, in which case it holds 7 bits of the
+	// key's hash. Slots are probed a group at a time by matching all of
+	// a group's control bytes at once, so keys are only compared on a
+	// likely hit.
 	struct Struct : public Object {
-		enum EntryState {
-			entryStateEmpty,
-			entryStateOccupied,
-			entryStateTombstone,
+		static constexpr size_t groupSize = 16;
+		
+		enum : int8_t {
+			ctrlEmpty = -128,
+			ctrlDeleted = -2,
 		};
 		
-		struct Entry {
-			EntryState state;
-			String *key;
-			Val val;
+		// Power of 2, at least groupSize
+		size_t nSlots;
+		
+		// Control bytes, keys, and values of each slot, in
+		// separate arrays sharing one allocation
+		int8_t *ctrl;
+		String **keys;
+		Val *vals;
+		
+		size_t nKeys;
+		
+		// Number of empty slots that can still be filled
+		// before the table needs rehashing
+		size_t growthLeft;
+		
+		// Changed whenever a key is added or removed, or keys are moved
+		// between slots, so the slot a key was found in can be used
+		// again, without looking it up, until this changes
+		size_t keysVersion;
+		
+		// Number of groups probed past the first to reach each key,
+		// for measuring the quality of the hash function
+		struct ProbeStats {
+			size_t nKeys;
+			size_t totalProbeLen, maxProbeLen;
 		};
 		
-		size_t nEntries;
-		Entry *entries;
+		// Slots are stored inline after the header in structs
+		// compacted into a region, and allocated separately otherwise
+		bool hasInlineSlots() const {
+			return isInRegion && (void*)keys == (void*)(this + 1);
+		}
 		
-		// Number of non-empty (occupied or tombstone) entries
-		size_t load;
+		// Bytes taken by the slot arrays of a table of nSlots slots
+		static size_t getSlotsSize(size_t nSlots) {
+			return nSlots * (sizeof(String*) + sizeof(Val) + 1);
+		}
 		
-		void expand(size_t newNEntries);
-		Entry *find(String *key);
+		// Point the slot arrays into buf, of getSlotsSize(nSlots) bytes
+		void setSlotsBuf(char *buf) {
+			// Keys and values first so each array stays aligned
+			keys = (String**)buf;
+			vals = (Val*)(buf + nSlots * sizeof(String*));
+			ctrl = (int8_t*)(buf + nSlots * (sizeof(String*) + sizeof(Val)));
+		}
+		
+		bool slotIsOccupied(size_t slot) const {
+			return ctrl[slot] >= 0;
+		}
+		
+		// Returns the slot holding key, or SIZE_MAX
+		size_t find(String *key);
 		bool get(String *key, Val *oVal);
-		void set(String *key, Val val);
-		void remove(String *key);
+		// Return false without changing anything if the struct is frozen
+		bool set(String *key, Val val);
+		bool remove(String *key);
+		
+		ProbeStats getProbeStats();
+		
+		// Create a struct that can hold nKeys keys without rehashing
+		static Struct *create(Heap *heap, size_t nKeys);
+		// Create a struct with the same keys and layout as tmpl, whose
+		// values are indices into vals of the values to use
+		static Struct *createFromTemplate(Heap *heap, Struct *tmpl, Val const *vals);
+		
+	private:
+		size_t findInsertSlot(uint32_t hash);
+		
+		// Rehash into a table of newNSlots slots
+		void rehash(size_t newNSlots);
+		// Rehash without reallocating, turning tombstones back
+		// into empty slots
+		void rehashInPlace();
 		
-		static Struct *create(Heap *heap, size_t nEntries);
+		void allocSlots(size_t nSlots);
 		
 	};
 }
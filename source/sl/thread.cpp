@@ -3,44 +3,128 @@
 #include <cassert>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 
 #include "array.h"
+#include "copy.h"
+#include "globals.h"
+#include "opstats.h"
+#include "profiler.h"
+#include "scheduler.h"
 #include "struct.h"
 
 namespace SL {
-	void Thread::call(Func *func, Val inst, size_t nInps, size_t nArgs) {
+	// Values and calls a thread's stacks start with room for
+	static constexpr size_t initialStackLen = 64;
+	static constexpr size_t initialCallStackLen = 8;
+	
+	// Position of a global slot's key that hasn't been looked up
+	// since the global struct's keys last changed
+	static constexpr size_t unknownGlobalPos = SIZE_MAX - 1;
+	
+	// Error aborting a script that ran out of fuel where
+	// the thread running it couldn't be suspended
+	static constexpr char const *outOfFuelMsg = "ran out of fuel where the thread can't be suspended";
+	
+	Call *Thread::call(Func *func, Val inst, size_t nInps, size_t nArgs) {
 		assert(func != nullptr);
 		assert(stack.len >= nInps);
 		
-		// Adjust to the correct number of arguments
-		if (nArgs > func->nParams) {
-			// If too many arguments were provided,
-			// pop the extra ones off the stack
-			stack.len = stack.len - nArgs + func->nParams;
-		} else if (nArgs < func->nParams) {
-			// If not enough arguments were provided,
-			// push nil onto the stack for the missing ones
-			for (auto i = size_t(0); i < func->nParams - nArgs; i++) {
-				stack.push(Val::newNil());
-			}
+		// Drop any arguments the function has no parameters for
+		auto nParams = func->nParams;
+		if (nArgs > nParams) {
+			stack.len -= nArgs - nParams;
+			nInps -= nArgs - nParams;
+			nArgs = nParams;
 		}
 		
-		nArgs = func->nParams;
+		auto prevStackBufLen = stack.bufLen, prevCallStackBufLen = callStack.bufLen;
 		
-		callStack.push(Call{
+		// Nils for any missing arguments, then the local
+		// variables, pushed in one go
+		auto nNils = (nParams - nArgs) + func->nLocals;
+		auto baseStackIdx = stack.len + (nParams - nArgs);
+		auto nils = stack.pushUninit(nNils);
+		for (auto i = size_t(0); i < nNils; i++) {
+			nils[i] = Val::newNil();
+		}
+		
+		callStack.pushForSignals(Call{
 			.func = func,
 			.inst = inst,
 			.opIt = func->ops,
-			.nInps = nInps,
-			.nArgs = nArgs,
-			.baseStackIdx = stack.len
+			.nInps = nInps + (nParams - nArgs),
+			.baseStackIdx = baseStackIdx
 		});
 		
-		// Push local variables onto the stack,
-		// defaulted to nils
-		for (auto i = size_t(0); i < func->nLocals; i++) {
-			stack.push(Val::newNil());
+		// Stacks only grow, and count towards the heap's limit
+		// once it's next collected
+		if (stack.bufLen != prevStackBufLen || callStack.bufLen != prevCallStackBufLen) {
+			heap->addBytes(
+				sizeof(Val) * (stack.bufLen - prevStackBufLen) +
+				sizeof(Call) * (callStack.bufLen - prevCallStackBufLen)
+			);
+		}
+		
+		return &callStack.buf[callStack.len - 1];
+	}
+	
+	void Thread::reportError(Func *func, Op *opIt, char const *msg) {
+		if (output) {
+			output->flush();
+		}
+		
+		if (!func) {
+			printf("%s\n", msg);
+			return;
+		}
+		
+		// opIt is the op after the one that failed
+		auto opIdx = size_t(opIt - func->ops);
+		printf("%.*s:%zu: %s\n",
+			int(func->file->nChars), func->file->getChars(),
+			func->getLine(opIdx > 0? opIdx - 1 : 0),
+			msg
+		);
+	}
+	
+	void Thread::reportHeapLimit(Func *func, Op *opIt) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "heap limit of %zu bytes reached", heap->maxBytes);
+		reportError(func, opIt, msg);
+	}
+	
+	void Thread::reportError(char const *msg) {
+		// Native functions are called from the op before
+		// the top call's opIt, if not by the host
+		if (callStack.len > 0) {
+			auto topCall = &callStack.buf[callStack.len - 1];
+			reportError(topCall->func, topCall->opIt, msg);
+		} else {
+			reportError(nullptr, nullptr, msg);
+		}
+	}
+	
+	bool Thread::callNative(Func *func, Val inst, size_t nInps, size_t nArgs) {
+		assert(func != nullptr && func->native != nullptr);
+		assert(stack.len >= nInps);
+		
+		Val r;
+		heap->nNativeCalls++;
+		auto ok = func->native(this, inst, nArgs, stack.buf + stack.len - nArgs, &r);
+		heap->nNativeCalls--;
+		if (!ok) {
+			return false;
 		}
+		if (isPreempted) {
+			return true;
+		}
+		
+		// Pop the inputs, push the result
+		stack.len -= nInps;
+		stack.push(r);
+		
+		return true;
 	}
 	
 	Val Thread::getElem(Val base, Val subscript) {
@@ -66,11 +150,14 @@ namespace SL {
 		return Val::newNil();
 	}
 	
-	void Thread::setElem(Val base, Val subscript, Val val) {
+	bool Thread::setElem(Val base, Val subscript, Val val) {
 		if (base.isArray() && subscript.isNumber()) {
 			auto array = base.arrayVal;
-			auto idxF = subscript.numberVal;
+			if (array->isFrozen) {
+				return false;
+			}
 			
+			auto idxF = subscript.numberVal;
 			if (idxF == trunc(idxF) && !std::isnan(idxF) && !std::isinf(idxF)) {
 				auto idx = ptrdiff_t(idxF);
 				
@@ -79,6 +166,10 @@ namespace SL {
 				}
 			}
 		} else if (base.isStruct()) {
+			if (base.structVal->isFrozen) {
+				return false;
+			}
+			
 			auto key = String::createFromVal(heap, subscript);
 			if (val.isNil()) {
 				base.structVal->remove(key);
@@ -86,47 +177,424 @@ namespace SL {
 				base.structVal->set(key, val);
 			}
 		}
+		return true;
+	}
+	
+	size_t Thread::getGlobalPos(size_t globalSlot) {
+		// Nothing is found until the global is a struct, so
+		// it's only read as one once something has been
+		if (globalSlot < nGlobalPoss && global.structVal->keysVersion == globalPossVersion) {
+			auto pos = globalPoss[globalSlot];
+			if (pos != unknownGlobalPos) {
+				return pos;
+			}
+		}
+		return findGlobalPos(globalSlot);
+	}
+	
+	size_t Thread::findGlobalPos(size_t globalSlot) {
+		if (!global.isStruct()) {
+			return SIZE_MAX;
+		}
+		auto s = global.structVal;
+		
+		if (s->keysVersion != globalPossVersion) {
+			for (auto i = size_t(0); i < nGlobalPoss; i++) {
+				globalPoss[i] = unknownGlobalPos;
+			}
+			globalPossVersion = s->keysVersion;
+		}
+		
+		if (globalSlot >= nGlobalPoss) {
+			auto newNGlobalPoss = nGlobalPoss > 0? nGlobalPoss : size_t(16);
+			while (newNGlobalPoss <= globalSlot) {
+				newNGlobalPoss *= 2;
+			}
+			
+			heap->reserveBytes(sizeof(size_t) * (newNGlobalPoss - nGlobalPoss));
+			auto newGlobalPoss = new size_t[newNGlobalPoss];
+			if (nGlobalPoss > 0) {
+				memcpy(newGlobalPoss, globalPoss, sizeof(size_t) * nGlobalPoss);
+			}
+			for (auto i = nGlobalPoss; i < newNGlobalPoss; i++) {
+				newGlobalPoss[i] = unknownGlobalPos;
+			}
+			
+			delete[] globalPoss;
+			globalPoss = newGlobalPoss;
+			nGlobalPoss = newNGlobalPoss;
+		}
+		
+		auto name = getGlobalName(uint32_t(globalSlot));
+		auto key = String::create(heap, name->size(), name->data());
+		auto pos = s->find(key);
+		globalPoss[globalSlot] = pos;
+		return pos;
+	}
+	
+	Val Thread::getGlobal(size_t globalSlot) {
+		auto pos = getGlobalPos(globalSlot);
+		return pos != SIZE_MAX? global.structVal->vals[pos] : Val::newNil();
+	}
+	
+	bool Thread::setGlobal(size_t globalSlot, Val val) {
+		auto pos = getGlobalPos(globalSlot);
+		if (pos == SIZE_MAX) {
+			// Writing nil to a global that isn't set leaves it unset
+			if (!val.isNil()) {
+				auto name = getGlobalName(uint32_t(globalSlot));
+				return setElem(global, Val::newString(String::create(heap, name->size(), name->data())), val);
+			}
+			return true;
+		}
+		
+		// As with setElem, writing nil removes the key
+		auto s = global.structVal;
+		if (s->isFrozen) {
+			return false;
+		}
+		if (val.isNil()) {
+			s->remove(s->keys[pos]);
+		} else {
+			s->vals[pos] = val;
+		}
+		return true;
 	}
 	
 	bool Thread::call(Func *func, Val inst, size_t nArgs, Val const *args, Val *oResult) {
 		assert(nArgs == 0 || args != nullptr);
 		assert(oResult != nullptr);
+		assert(!isPreempted);
+		
+		nHostCalls++;
 		
-		// Push arguments onto the stack
-		for (auto i = size_t(0); i < nArgs; i++) {
-			stack.push(args[i]);
+		// Calls back from native functions hold off collection
+		auto isCallback = heap->nNativeCalls > 0;
+		if (isCallback) {
+			heap->nCallbacks++;
+		}
+		
+		bool r;
+		if (func->native) {
+			heap->nNativeCalls++;
+			try {
+				r = func->native(this, inst, nArgs, args, oResult);
+			} catch (HeapLimitError const &) {
+				// Called by the host, or by another native function
+				// from the op before the top call's opIt
+				if (callStack.len > 0) {
+					auto topCall = &callStack.buf[callStack.len - 1];
+					reportHeapLimit(topCall->func, topCall->opIt);
+				} else {
+					reportHeapLimit(nullptr, nullptr);
+				}
+				r = false;
+			}
+			heap->nNativeCalls--;
+			
+			// Such as resume, when the coroutine ran out of fuel.
+			// Native functions called by the host or other native
+			// functions can't be called again on resume.
+			if (isPreempted) {
+				isPreempted = false;
+				reportError(outOfFuelMsg);
+				r = false;
+			}
+		} else {
+			// Push arguments onto the stack
+			for (auto i = size_t(0); i < nArgs; i++) {
+				stack.push(args[i]);
+			}
+			
+			// Call the function, run until it returns to us
+			call(func, inst, nArgs, nArgs);
+			r = runUntilReturnToHost(callStack.len - 1, oResult);
+			if (isPreempted) {
+				state = threadStateSuspended;
+			}
 		}
 		
-		// Call the function, run until it returns to us
-		call(func, inst, 0, nArgs);
-		return runUntilReturnToHost(oResult);
+		if (isCallback) {
+			heap->nCallbacks--;
+		}
+		nHostCalls--;
+		return r;
 	}
 	
-	bool Thread::runUntilReturnToHost(Val *oResult) {
+	bool Thread::resume(Val val, Val *oResult) {
+		assert((isCoroutine || task || isPreempted) && state == threadStateSuspended);
+		assert(oResult != nullptr);
+		
+		state = threadStateRunning;
+		
+		if (entryFunc) {
+			auto func = entryFunc;
+			auto args = entryArgs;
+			entryFunc = nullptr;
+			entryArgs = nullptr;
+			
+			if (func->native) {
+				// Native functions (only spawned ones) can't be
+				// suspended, so run to completion
+				auto r = call(func, entryInst, args->nElems, args->elems, oResult);
+				state = threadStateDone;
+				return r;
+			}
+			
+			for (auto i = size_t(0); i < args->nElems; i++) {
+				stack.push(args->elems[i]);
+			}
+			call(func, entryInst, args->nElems, args->nElems);
+		} else if (isPreempted) {
+			isPreempted = false;
+		} else {
+			// Replace the result of the native function
+			// that yielded with the value passed in
+			assert(stack.len > 0);
+			stack.buf[stack.len - 1] = val;
+		}
+		
+		// Coroutines burn the fuel of whichever thread resumed them
+		auto resumer = isCoroutine? runningThread : nullptr;
+		if (resumer) {
+			fuel = resumer->fuel;
+		}
+		
+		auto r = runUntilReturnToHost(0, oResult);
+		
+		// Coroutines out of fuel suspend whoever resumed them
+		// too, to be resumed again once it's resumed
+		if (resumer) {
+			resumer->fuel = fuel;
+			resumer->isPreempted = isPreempted;
+		}
+		
+		// The call stack is empty once the coroutine's function
+		// has returned or the script was aborted. Threads of the
+		// host go back to waiting for their next call.
+		if (callStack.len > 0) {
+			state = threadStateSuspended;
+		} else {
+			state = (isCoroutine || task)? threadStateDone : threadStateRunning;
+		}
+		return r;
+	}
+	
+	void Thread::cancel() {
+		assert(isPreempted && !isCoroutine && !task);
+		callStack.len = 0;
+		stack.len = 0;
+		isPreempted = false;
+		state = threadStateRunning;
+	}
+	
+	bool Thread::yield() {
+		if ((!isCoroutine && !task) || nHostCalls > 0) {
+			return false;
+		}
+		
+		isYielding = true;
+		return true;
+	}
+	
+	bool Thread::join(Thread *joiner, Val *oResult) {
+		assert(task != nullptr);
+		
+		if (joiner->scheduler) {
+			joiner->scheduler->wait(task, joiner->output);
+		}
+		assert(task->isDone.load(std::memory_order_acquire));
+		
+		auto ok = task->ok;
+		if (ok) {
+			try {
+				*oResult = copyVal(joiner->heap, &task->heap, task->result);
+			} catch (HeapLimitError const &) {
+				task->heap.deinit();
+				delete task;
+				task = nullptr;
+				heap = nullptr;
+				state = threadStateDone;
+				throw;
+			}
+		}
+		
+		task->heap.deinit();
+		delete task;
+		task = nullptr;
+		heap = nullptr;
+		state = threadStateDone;
+		
+		return ok;
+	}
+	
+	bool Thread::runUntilReturnToHost(size_t hostCallStackLen, Val *oResult) {
+		RunningThreadScope runningScope(this);
+		
+		assert(hostCallStackLen < callStack.len);
+		auto hostCall = &callStack.buf[hostCallStackLen];
+		auto hostStackLen = hostCall->baseStackIdx - hostCall->nInps;
+		
+		// Native functions unwound past don't get to count themselves out
+		auto nNativeCalls = heap->nNativeCalls;
+		
+		// Caught out here, as the loop running the ops is faster without
+		// a handler in it. Ops that can run into the limit point the top
+		// call at themselves first, or just past if they call.
+		try {
+			return runOps(hostCallStackLen, oResult);
+		} catch (HeapLimitError const &) {
+			heap->nNativeCalls = nNativeCalls;
+			
+			auto topCall = &callStack.buf[callStack.len - 1];
+			reportHeapLimit(topCall->func, topCall->opIt);
+			
+			callStack.len = hostCallStackLen;
+			stack.len = hostStackLen;
+			
+			// Once back out of the script, don't leave the stacks of
+			// runaway recursion, or what the script was holding, counted
+			// against the limit for whatever runs next
+			if (callStack.len == 0 && stack.len == 0) {
+				stack.deinit();
+				stack.init(initialStackLen);
+				callStack.deinit();
+				callStack.init(initialCallStackLen);
+			}
+			if (heap->collector && heap->rootThread && heap->nCallbacks == 0) {
+				heap->collect();
+			}
+			return false;
+		}
+	}
+	
+	bool Thread::runOps(size_t hostCallStackLen, Val *oResult) {
 		Call *topCall;
 		Func *func;
 		Val inst;
 		Val *consts;
 		Op *opIt;
 		size_t nInps;
-		size_t nArgs;
 		size_t baseStackIdx;
 		
-		auto refreshLocals = [&]() {
-			topCall = &callStack.buf[callStack.len - 1];
+		auto loadTopCall = [&]() {
 			func = topCall->func;
 			inst = topCall->inst;
 			consts = func->consts;
 			opIt = topCall->opIt;
 			nInps = topCall->nInps;
-			nArgs = topCall->nArgs;
 			baseStackIdx = topCall->baseStackIdx;
 		};
+		auto refreshLocals = [&]() {
+			topCall = &callStack.buf[callStack.len - 1];
+			loadTopCall();
+		};
 		refreshLocals();
 		
+		// Push a call to callee and start running it. Most calls pass
+		// as many arguments as there are parameters, and find room for
+		// the frame on both stacks, so are pushed here, keeping what's
+		// known of the frame in locals rather than reloading it.
+		auto enterCall = [&](Func *callee, Val calleeInst, size_t nCalleeInps, size_t nCalleeArgs) {
+			auto nLocals = callee->nLocals;
+			if (nCalleeArgs != callee->nParams ||
+				stack.bufLen - stack.len < nLocals ||
+				callStack.len == callStack.bufLen
+			) {
+				topCall = call(callee, calleeInst, nCalleeInps, nCalleeArgs);
+				loadTopCall();
+				return;
+			}
+			
+			baseStackIdx = stack.len;
+			for (auto i = size_t(0); i < nLocals; i++) {
+				stack.buf[baseStackIdx + i] = Val::newNil();
+			}
+			stack.len += nLocals;
+			
+			callStack.pushForSignals(Call{
+				.func = callee,
+				.inst = calleeInst,
+				.opIt = callee->ops,
+				.nInps = nCalleeInps,
+				.baseStackIdx = baseStackIdx
+			});
+			topCall = &callStack.buf[callStack.len - 1];
+			
+			func = callee;
+			inst = calleeInst;
+			consts = callee->consts;
+			opIt = callee->ops;
+			nInps = nCalleeInps;
+		};
+		
+		// Drop the top call for a tail call it's making, moving the
+		// nCallInps inputs of the call made down over its own, so that
+		// recursing through tail calls runs in constant space
+		auto dropForTailCall = [&](size_t nCallInps) {
+			auto inpsIdx = baseStackIdx - nInps;
+			memmove(stack.buf + inpsIdx, stack.buf + stack.len - nCallInps, sizeof(Val) * nCallInps);
+			stack.len = inpsIdx + nCallInps;
+			callStack.pop();
+		};
+		
+		// The host may itself have been called from the VM (by a native
+		// function), so only return to it once its call has returned,
+		// and unwind back to this point if the script is aborted
+		assert(hostCallStackLen < callStack.len);
+		auto hostCall = &callStack.buf[hostCallStackLen];
+		auto hostStackLen = hostCall->baseStackIdx - hostCall->nInps;
+		auto unwind = [&]() {
+			callStack.len = hostCallStackLen;
+			stack.len = hostStackLen;
+			return false;
+		};
+		
+		// Return to the resumer, leaving the coroutine's state in place.
+		// The value yielded is the result of the native function that
+		// yielded, which stays on the stack to be replaced on resume.
+		auto suspend = [&]() {
+			isYielding = false;
+			*oResult = stack.buf[stack.len - 1];
+			return true;
+		};
+		
+		// Burn n units of fuel, returning false if there wasn't enough
+		auto burnFuel = [&](size_t n) {
+			if (fuel > n) {
+				fuel -= n;
+				return true;
+			}
+			fuel = 0;
+			return false;
+		};
+		
+		// Suspend the thread for running out of fuel, leaving the ops to
+		// be run from the top call's opIt on resume. Only the thread's
+		// bottom calls can be, as a native function calling back would be
+		// left behind, so anywhere else the script is aborted instead.
+		auto canPreempt = hostCallStackLen == 0 && nHostCalls <= 1;
+		auto preempt = [&]() {
+			if (canPreempt) {
+				isPreempted = true;
+				return true;
+			}
+			isPreempted = false;
+			reportError(func, opIt, outOfFuelMsg);
+			return unwind();
+		};
+		
+#ifdef SL_OPCODE_STATS
+		OpRecorder opRecorder;
+		opRecorder.init();
+#endif
+		
 		for (;;) {
 			assert(opIt < func->ops + func->nOps);
 			auto op = *opIt++;
+#ifdef SL_OPCODE_STATS
+			opRecorder.record(op.opcode);
+#endif
 			switch (op.opcode) {
 			case opcodeGetInst: {
 				stack.push(inst);
@@ -136,6 +604,23 @@ namespace SL {
 				stack.push(global);
 				break;
 			}
+			case opcodeGetGlobalSlot: {
+				topCall->opIt = opIt - 1;
+				stack.push(getGlobal(size_t(op.arg)));
+				break;
+			}
+			case opcodeSetGlobalSlot: {
+				assert(stack.len >= 1);
+				
+				auto val = stack.pop();
+				topCall->opIt = opIt - 1;
+				if (!setGlobal(size_t(op.arg), val)) {
+					reportError(func, opIt, "can't write to a frozen struct");
+					return unwind();
+				}
+				
+				break;
+			}
 			case opcodeGetConst: {
 				assert(op.arg >= 0 && op.arg < func->nConsts);
 				stack.push(consts[op.arg]);
@@ -157,6 +642,9 @@ namespace SL {
 				
 				auto subscript = stack.pop();
 				auto base = stack.pop();
+				if (base.isStruct()) {
+					topCall->opIt = opIt - 1;
+				}
 				stack.push(getElem(base, subscript));
 				
 				break;
@@ -167,7 +655,16 @@ namespace SL {
 				auto val = stack.pop();
 				auto subscript = stack.pop();
 				auto base = stack.pop();
-				setElem(base, subscript, val);
+				if (base.isStruct()) {
+					topCall->opIt = opIt - 1;
+				}
+				if (!setElem(base, subscript, val)) {
+					reportError(func, opIt, base.isArray()?
+						"can't write to a frozen array" :
+						"can't write to a frozen struct"
+					);
+					return unwind();
+				}
 				
 				break;
 			}
@@ -190,15 +687,13 @@ namespace SL {
 				if (a.isNumber() && b.isNumber()) {
 					stack.push(Val::newNumber(a.numberVal + b.numberVal));
 				} else if (a.isString() || b.isString()) {
+					// Let allocations be traced back to this op
+					topCall->opIt = opIt - 1;
+					
 					auto aStr = String::createFromVal(heap, a);
 					auto bStr = String::createFromVal(heap, b);
 					
-					auto len = aStr->nChars + bStr->nChars;
-					auto r = String::create(heap, len);
-					memcpy(r->chars, aStr->chars, aStr->nChars);
-					memcpy(r->chars + aStr->nChars, bStr->chars, bStr->nChars);
-					
-					stack.push(Val::newString(r));
+					stack.push(Val::newString(String::createConcat(heap, aStr, bStr)));
 				} else {
 					stack.push(Val::newNil());
 				}
@@ -305,6 +800,7 @@ namespace SL {
 				auto nElems = op.arg;
 				assert(stack.len >= nElems);
 				
+				topCall->opIt = opIt - 1;
 				auto r = Array::create(heap, nElems);
 				memcpy(r->elems, stack.buf + stack.len - nElems, sizeof(Val) * nElems);
 				stack.len -= nElems;
@@ -314,31 +810,47 @@ namespace SL {
 				break;
 			}
 			case opcodeMakeStruct: {
-				auto nElems = op.arg;
-				assert(stack.len >= nElems * 2);
+				assert(op.arg >= 0 && op.arg < func->nConsts);
+				assert(consts[op.arg].isStruct());
 				
-				auto r = Struct::create(heap, 16);
+				auto tmpl = consts[op.arg].structVal;
+				auto nVals = tmpl->nKeys;
+				assert(stack.len >= nVals);
 				
-				for (auto i = size_t(0); i < nElems; i++) {
-					auto v = stack.pop();
-					auto key = stack.pop();
-					
-					r->set(String::createFromVal(heap, key), v);
-				}
+				topCall->opIt = opIt - 1;
+				auto r = Struct::createFromTemplate(heap, tmpl, stack.buf + stack.len - nVals);
+				stack.len -= nVals;
 				
 				stack.push(Val::newStruct(r));
 				
 				break;
 			}
 			case opcodePrint: {
-				auto v = stack.pop();
-				auto str = String::createFromVal(heap, v);
-				puts(str->chars);
+				topCall->opIt = opIt - 1;
+				output->printVal(stack.pop());
 				break;
 			}
 			case opcodeJmp: {
 				assert(op.arg >= 0 && op.arg < func->nOps);
-				opIt = func->ops + op.arg;
+				
+				// Every loop jumps back, so can't allocate
+				// forever without passing through here. The
+				// collector may move the instance.
+				if (heap->isCollectDue()) {
+					topCall->opIt = opIt - 1;
+					heap->collectWithinLimit();
+					inst = topCall->inst;
+				}
+				
+				// Burnt before jumping, so that running out is
+				// reported at the jump, but resumed from its target
+				auto to = func->ops + op.arg;
+				if (to < opIt && !burnFuel(size_t(opIt - to))) {
+					topCall->opIt = to;
+					return preempt();
+				}
+				opIt = to;
+				topCall->opIt = opIt;
 				break;
 			}
 			case opcodeJmpN: {
@@ -347,47 +859,175 @@ namespace SL {
 				if (!v.asBool()) {
 					opIt = func->ops + op.arg;
 				}
+				topCall->opIt = opIt;
 				break;
 			}
-			case opcodeCall: {
-				auto nArgs = op.arg;
-				assert(nArgs >= 0);
+			case opcodeIterInit: {
+				assert(stack.len > 0);
+				assert(baseStackIdx + op.arg + 4 < stack.len);
+				
+				// Locals are the value iterated over, a snapshot of
+				// its keys, the cursor, the key, and the value
+				auto locals = stack.buf + baseStackIdx + op.arg;
+				auto v = stack.pop();
+				locals[0] = v;
+				locals[1] = Val::newNil();
+				locals[2] = Val::newNumber(0.0);
 				
-				// Access the called function from the stack,
-				// try to call it
-				auto tFunc = stack.buf[stack.len - nArgs - 1];
-				if (tFunc.isFunc()) {
-					topCall->opIt = opIt;
+				if (v.isStruct()) {
+					// Iterate over the keys present now, so the loop is
+					// unaffected by the struct being rehashed
+					auto s = v.structVal;
+					topCall->opIt = opIt - 1;
+					auto keys = Array::create(heap, s->nKeys);
+					auto nKeys = size_t(0);
+					for (auto i = size_t(0); i < s->nSlots; i++) {
+						if (s->slotIsOccupied(i)) {
+							keys->elems[nKeys++] = Val::newString(s->keys[i]);
+						}
+					}
+					assert(nKeys == s->nKeys);
 					
-					call(tFunc.funcVal, inst, nArgs + 1, nArgs);
-					refreshLocals();
-				} else {
-					// Value called wasn't a function,
-					// return nil
-					stack.len = stack.len - nArgs - 1;
-					stack.push(Val::newNil());
+					locals[1] = Val::newArray(keys);
 				}
+				
 				break;
 			}
-			case opcodeInstCall: {
+			case opcodeIterNext: {
+				assert(baseStackIdx + op.arg + 4 < stack.len);
+				
+				auto locals = stack.buf + baseStackIdx + op.arg;
+				auto cursor = size_t(locals[2].numberVal);
+				auto hasNext = false;
+				
+				if (locals[0].isArray()) {
+					auto array = locals[0].arrayVal;
+					if (cursor < array->nElems) {
+						locals[3] = Val::newNumber(double(cursor));
+						locals[4] = array->elems[cursor];
+						cursor++;
+						hasNext = true;
+					}
+				} else if (locals[0].isStruct()) {
+					// Skip keys removed since the loop started
+					auto s = locals[0].structVal;
+					auto keys = locals[1].arrayVal;
+					while (cursor < keys->nElems) {
+						auto key = keys->elems[cursor++].stringVal;
+						auto slot = s->find(key);
+						if (slot != SIZE_MAX) {
+							locals[3] = Val::newString(key);
+							locals[4] = s->vals[slot];
+							hasNext = true;
+							break;
+						}
+					}
+				} else if (locals[0].isThread()) {
+					// Resume a coroutine for each value it yields,
+					// stopping once it returns
+					auto co = locals[0].threadVal;
+					if (co->isCoroutine && co->state == threadStateSuspended) {
+						Val v;
+						if (!co->resume(Val::newNil(), &v)) {
+							return unwind();
+						}
+						if (isPreempted) {
+							// Resume it again from here on resume
+							topCall->opIt = opIt - 1;
+							return preempt();
+						}
+						
+						// The coroutine shares the heap, so may
+						// have collected it, moving the instance
+						inst = topCall->inst;
+						if (co->state != threadStateDone) {
+							locals[3] = Val::newNumber(double(cursor));
+							locals[4] = v;
+							cursor++;
+							hasNext = true;
+						}
+					}
+				}
+				
+				locals[2] = Val::newNumber(double(cursor));
+				stack.push(Val::fromBool(hasNext));
+				
+				break;
+			}
+			case opcodeCall:
+			case opcodeTailCall:
+			case opcodeInstCall:
+			case opcodeTailInstCall: {
 				auto nArgs = op.arg;
 				assert(nArgs >= 0);
 				
-				// Retrieve the function from the instance,
-				// try to call it
-				auto base = stack.buf[stack.len - nArgs - 2];
-				auto subscript = stack.buf[stack.len - nArgs - 1];
-				auto tFunc = getElem(base, subscript);
-				if (tFunc.isFunc()) {
-					topCall->opIt = opIt;
-					
-					call(tFunc.funcVal, base, nArgs + 2, nArgs);
-					refreshLocals();
+				// Functions are called from the stack, with the current
+				// instance, and methods retrieved from the instance and
+				// key below the arguments, with that instance
+				auto isInstCall = op.opcode == opcodeInstCall || op.opcode == opcodeTailInstCall;
+				Val tFunc, tInst;
+				size_t nCallInps;
+				if (isInstCall) {
+					tInst = stack.buf[stack.len - nArgs - 2];
+					tFunc = getElem(tInst, stack.buf[stack.len - nArgs - 1]);
+					nCallInps = nArgs + 2;
 				} else {
+					tFunc = stack.buf[stack.len - nArgs - 1];
+					tInst = inst;
+					nCallInps = nArgs + 1;
+				}
+				
+				if (!tFunc.isFunc()) {
 					// Value called wasn't a function,
 					// return nil
-					stack.len = stack.len - nArgs - 1;
+					stack.len = stack.len - nCallInps;
 					stack.push(Val::newNil());
+					break;
+				}
+				
+				topCall->opIt = opIt;
+				if (tFunc.funcVal->native) {
+					// Native functions can allocate a lot at once, so
+					// calling one is also a chance to collect. Functions
+					// never move, but the instances may.
+					if (heap->isCollectDue()) {
+						heap->collectWithinLimit();
+						inst = topCall->inst;
+						tInst = isInstCall? stack.buf[stack.len - nArgs - 2] : inst;
+					}
+					
+					if (!callNative(tFunc.funcVal, tInst, nCallInps, nArgs)) {
+						return unwind();
+					}
+					if (isYielding) {
+						return suspend();
+					}
+					if (isPreempted) {
+						// Call it again, with the inputs
+						// left in place, on resume
+						topCall->opIt = opIt - 1;
+						return preempt();
+					}
+					
+					// Native functions calling back may have moved
+					// the call stack, and collecting the instance
+					refreshLocals();
+					break;
+				}
+				
+				if (op.opcode == opcodeTailCall || op.opcode == opcodeTailInstCall) {
+					dropForTailCall(nCallInps);
+				}
+				enterCall(tFunc.funcVal, tInst, nCallInps, nArgs);
+				
+				// Recursion can allocate without looping, so
+				// each call is also a chance to collect
+				if (heap->isCollectDue()) {
+					heap->collectWithinLimit();
+					inst = topCall->inst;
+				}
+				if (!burnFuel(1)) {
+					return preempt();
 				}
 				break;
 			}
@@ -401,7 +1041,7 @@ namespace SL {
 				
 				// Pop the current call off the call stack
 				callStack.pop();
-				if (callStack.len > 0) {
+				if (callStack.len > hostCallStackLen) {
 					refreshLocals();
 					// If returning into a VM function,
 					// push the return value back onto the stack
@@ -420,12 +1060,112 @@ namespace SL {
 		}
 	}
 	
-	Thread *Thread::create(Heap *heap, Val global) {
+	Thread *Thread::create(Heap *heap, Val global, Output *output) {
 		auto r = (Thread*)heap->createObject(sizeof(Thread), objectTypeThread);
 		r->heap = heap;
 		r->global = global;
-		r->stack.init(64);
-		r->callStack.init(8);
+		r->stack.init(initialStackLen);
+		r->callStack.init(initialCallStackLen);
+		r->output = output;
+		r->scheduler = nullptr;
+		r->task = nullptr;
+		r->isCoroutine = false;
+		r->state = threadStateRunning;
+		r->entryFunc = nullptr;
+		r->entryInst = Val::newNil();
+		r->entryArgs = nullptr;
+		r->fuel = SIZE_MAX;
+		r->nHostCalls = 0;
+		r->isYielding = false;
+		r->isPreempted = false;
+		r->nGlobalPoss = 0;
+		r->globalPoss = nullptr;
+		r->globalPossVersion = 0;
+		
+		return r;
+	}
+	
+	Thread *Thread::createCoroutine(Thread *creator, Func *func, Val inst, size_t nArgs, Val const *args) {
+		assert(func != nullptr && func->native == nullptr);
+		assert(nArgs == 0 || args != nullptr);
+		
+		auto r = create(creator->heap, creator->global, creator->output);
+		r->scheduler = creator->scheduler;
+		r->isCoroutine = true;
+		r->state = threadStateSuspended;
+		r->entryFunc = func;
+		r->entryInst = inst;
+		r->entryArgs = Array::create(creator->heap, nArgs);
+		if (nArgs > 0) {
+			memcpy(r->entryArgs->elems, args, sizeof(Val) * nArgs);
+		}
+		
+		return r;
+	}
+	
+	Thread *Thread::createTask(Thread *spawner, Func *func, size_t nArgs, Val const *args) {
+		assert(func != nullptr);
+		assert(nArgs == 0 || args != nullptr);
+		
+		auto task = new Task;
+		task->heap.init(spawner->heap->collector);
+		task->heap.setMaxBytes(spawner->heap->maxBytes);
+		task->waitChannel = nullptr;
+		task->isWaitingToSend = false;
+		task->waitVal = Val::newNil();
+		task->isDone.store(false, std::memory_order_relaxed);
+		
+		// Copying what the task is handed, and creating its thread, can
+		// run into the limit of the task's heap or the spawner's, which
+		// leaves the task to be freed, as it hasn't started
+		Struct *global;
+		Array *taskArgs;
+		Func *entryFunc;
+		Thread *r;
+		try {
+			// The task sees the spawner's top-level functions and frozen
+			// globals, which are immutable so can be shared, but must be
+			// passed any other data
+			global = Struct::create(&task->heap, 16);
+			if (spawner->global.isStruct()) {
+				auto spawnerGlobal = spawner->global.structVal;
+				for (auto i = size_t(0); i < spawnerGlobal->nSlots; i++) {
+					if (!spawnerGlobal->slotIsOccupied(i)) {
+						continue;
+					}
+					
+					auto val = spawnerGlobal->vals[i];
+					auto isShared = val.isFunc() ||
+						((val.isString() || val.isArray() || val.isStruct()) && ((Object*)val.ptrVal)->isFrozen);
+					if (isShared) {
+						auto key = copyVal(&task->heap, spawner->heap, Val::newString(spawnerGlobal->keys[i])).stringVal;
+						global->set(key, copyVal(&task->heap, spawner->heap, val));
+					}
+				}
+			}
+			
+			taskArgs = Array::create(&task->heap, nArgs);
+			copyVals(&task->heap, spawner->heap, nArgs, args, taskArgs->elems);
+			entryFunc = copyVal(&task->heap, spawner->heap, Val::newFunc(func)).funcVal;
+			
+			// The thread itself belongs to the spawner, as its handle to the
+			// task, but allocates from the task's heap when running
+			r = create(spawner->heap, Val::newStruct(global), nullptr);
+		} catch (HeapLimitError const &) {
+			task->heap.deinit();
+			delete task;
+			throw;
+		}
+		
+		r->heap = &task->heap;
+		r->scheduler = spawner->scheduler;
+		r->task = task;
+		r->state = threadStateSuspended;
+		r->entryFunc = entryFunc;
+		r->entryInst = r->global;
+		r->entryArgs = taskArgs;
+		task->thread = r;
+		task->heap.rootThread = r;
 		
 		return r;
 	}
@@ -433,5 +1173,8 @@ namespace SL {
 	void Thread::deinit() {
 		callStack.deinit();
 		stack.deinit();
+		delete[] globalPoss;
+		globalPoss = nullptr;
+		nGlobalPoss = 0;
 	}
 }
@@ -3,19 +3,42 @@
 #include "darray.h"
 #include "func.h"
 #include "heap.h"
+#include "output.h"
 #include "val.h"
 
 namespace SL {
 	struct Call {
 		Func *func;
 		Val inst;
+		// Op after the last call made, for calls further out. For the
+		// top call, the op last jumped to or allocating, for the profiler
+		// and allocation tracking to see.
 		Op *opIt;
-		size_t nInps, nArgs;
+		// Number of values below baseStackIdx belonging to the call:
+		// the function or instance and key called, and the arguments,
+		// as many as the function has parameters
+		size_t nInps;
 		size_t baseStackIdx;
 	};
 	
 	struct Val;
+	struct Array;
+	struct Scheduler;
+	struct Task;
 	
+	enum ThreadState {
+		// Coroutine not started yet, or waiting in yield, or any
+		// thread run by the host or scheduler out of fuel
+		threadStateSuspended,
+		threadStateRunning,
+		threadStateDone,
+	};
+	
+	// A thread of execution, with its own stacks. Threads created by
+	// the host run when called into, coroutines when resumed by another
+	// thread, handing control back with yield. Switching between them
+	// involves no OS threads. Spawned tasks also each run on a thread,
+	// in parallel on the scheduler's OS threads.
 	struct Thread : public Object {
 		Heap *heap;
 		Val global;
@@ -23,18 +46,129 @@ namespace SL {
 		DArray<Val> stack;
 		DArray<Call> callStack;
 		
+		// Destination of print statements, shared
+		// with any coroutines created from this thread
+		Output *output;
+		
+		// Runs tasks spawned from this thread, or null
+		// to run them straight away
+		Scheduler *scheduler;
+		
+		// Task running on this thread, until joined
+		Task *task;
+		
+		bool isCoroutine;
+		ThreadState state;
+		
+		// Budget of ops left to run before the thread is suspended, so
+		// whoever ran it can run something else before resuming it, or
+		// give up on it. Loops burn one unit per op they jump back over
+		// and calls to script functions one each, as one or the other
+		// must be passed through to run for long. Coroutines burn the
+		// fuel of the thread resuming them, and running out suspends
+		// that thread as well, to resume the coroutine again when it's
+		// resumed. Threads can only be suspended with no native function
+		// calling back into them; running out anywhere else, such as in
+		// a sort's comparison function, aborts the script with an error
+		// instead. SIZE_MAX by default, which never runs out.
+		size_t fuel;
+		
+		// Function to call on a coroutine's first resume,
+		// and the instance and arguments to call it with
+		Func *entryFunc;
+		Val entryInst;
+		Array *entryArgs;
+		
+		// Call a function, returning false if the script was aborted. If
+		// the thread runs out of fuel, returns with it suspended instead,
+		// and the result is only given once it's resumed to the end.
 		bool call(Func *func, Val inst, size_t nArgs, Val const *args, Val *oResult);
 		
-		static Thread *create(Heap *heap, Val global);
+		// Run a suspended coroutine (or task) until it yields or returns,
+		// giving the value yielded or returned. val is passed to the
+		// coroutine as the result of yield, and is ignored on the first
+		// resume or when continuing a thread that ran out of fuel. A
+		// coroutine that runs out returns with no value, leaving the
+		// thread resuming it to be suspended too.
+		bool resume(Val val, Val *oResult);
+		// Drop the calls of a thread the host ran that ran out of fuel,
+		// as if the script had been aborted, leaving it ready for the
+		// next call
+		void cancel();
+		// Called by a native function to suspend the coroutine once it
+		// returns, handing its result to the resumer. Returns false if
+		// the thread can't yield.
+		bool yield();
+		// Called by a native function about to return false, to print
+		// the error aborting the script at the call to it
+		void reportError(char const *msg);
+		
+		// Wait for a spawned task to finish, and copy its
+		// result into the heap of joiner
+		bool join(Thread *joiner, Val *oResult);
+		
+		static Thread *create(Heap *heap, Val global, Output *output);
+		static Thread *createCoroutine(Thread *creator, Func *func, Val inst, size_t nArgs, Val const *args);
+		// Create a task calling func, with copies of args and of the
+		// functions in spawner's globals. Returns the thread it will
+		// run on, to be passed to the scheduler. The thread is run like
+		// a coroutine, so can be suspended while the task waits.
+		static Thread *createTask(Thread *spawner, Func *func, size_t nArgs, Val const *args);
+		// Free the stacks, which tasks do as soon as they finish.
+		// Safe to call more than once.
 		void deinit();
 		
+		// Bytes taken by the positions of globals found
+		size_t getGlobalPossSize() const {
+			return sizeof(size_t) * nGlobalPoss;
+		}
+		
 	private:
+		// Number of calls into the VM by native functions on this thread
+		// still to return. A coroutine can only yield if there are none,
+		// as suspending would leave their C++ frames behind.
+		size_t nHostCalls;
+		bool isYielding;
+		// Whether the thread was suspended by running out of fuel, or by
+		// a coroutine it resumed running out, so resumes where it was
+		// rather than from a native function
+		bool isPreempted;
+		
+		// Where the keys of the global slots looked up so far are in the
+		// global struct, by slot, found while its keysVersion was
+		// globalPossVersion. Allocated once globals are first looked up.
+		size_t nGlobalPoss;
+		size_t *globalPoss;
+		size_t globalPossVersion;
+		
+		// Writes return false, having written nothing, if the
+		// array or struct written to is frozen
 		Val getElem(Val base, Val subscript);
-		void setElem(Val base, Val subscript, Val val);
+		bool setElem(Val base, Val subscript, Val val);
+		
+		// Slot in the global struct holding the key of the global in
+		// globalSlot, or SIZE_MAX if there's none. Looking it up
+		// allocates, so only once the op doing so has been published.
+		size_t getGlobalPos(size_t globalSlot);
+		size_t findGlobalPos(size_t globalSlot);
+		Val getGlobal(size_t globalSlot);
+		bool setGlobal(size_t globalSlot, Val val);
+		
+		// Push a call to func, whose nInps inputs (the last nArgs of them
+		// arguments) are on top of the stack, returning it
+		Call *call(Func *func, Val inst, size_t nInps, size_t nArgs);
+		bool callNative(Func *func, Val inst, size_t nInps, size_t nArgs);
 		
-		void call(Func *func, Val inst, size_t nInps, size_t nArgs);
+		// Print the error aborting the script, at the op before
+		// opIt in func, or with no location if func is null
+		void reportError(Func *func, Op *opIt, char const *msg);
+		void reportHeapLimit(Func *func, Op *opIt);
 		
-		bool runUntilReturnToHost(Val *oResult);
+		// Run until the call at hostCallStackLen returns or the
+		// coroutine yields, aborting the script if the heap's limit
+		// is reached on the way
+		bool runUntilReturnToHost(size_t hostCallStackLen, Val *oResult);
+		bool runOps(size_t hostCallStackLen, Val *oResult);
 		
 	};
 }
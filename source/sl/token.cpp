@@ -32,7 +32,8 @@ namespace SL {
 			"'func'", "'this'", "'global'",
 			"'print'", "'var'", "'if'",
 			"'else'", "'while'", "'break'",
-			"'continue'", "'return'",
+			"'continue'", "'return'", "'for'",
+			"'in'",
 			
 			"'=='", "'!='", "'&&'",
 			"'||'", "'<='", "'>='",
@@ -31,6 +31,8 @@ namespace SL {
 		tokenKindKwBreak,
 		tokenKindKwContinue,
 		tokenKindKwReturn,
+		tokenKindKwFor,
+		tokenKindKwIn,
 		
 		tokenKindEq, // ==
 		tokenKindNEq, // !=
@@ -4,7 +4,10 @@
 #include <cstdio>
 #include <cstring>
 
+#include "allocstats.h"
+#include "darray.h"
 #include "heap.h"
+#include "number.h"
 
 namespace SL {
 	bool Val::equals(Val other) const {
@@ -23,12 +26,121 @@ namespace SL {
 		}
 	}
 	
-	uint32_t String::hash() {
-		auto r = uint32_t(nChars);
-		for (auto i = size_t(0); i < nChars; i++) {
-			r ^= ((r << 5) + (r >> 2) + uint32_t(chars[i]));
+	void String::flatten() {
+		if (isFlat()) {
+			return;
+		}
+		
+		reserveRunningHeapBytes(nChars + 1);
+		auto buf = new char[nChars + 1];
+		buf[nChars] = 0;
+		trackBufferAlloc(objectTypeString, nChars + 1);
+		
+		// Fill the buffer from the end, walking the tree right to left.
+		// Strings built by repeated appends are left-leaning, so this
+		// keeps the number of pending nodes small.
+		DArray<String*> pending;
+		pending.init(16);
+		pending.push(this);
+		
+		auto end = buf + nChars;
+		while (pending.len > 0) {
+			auto s = pending.pop();
+			if (s->isFlat()) {
+				end -= s->nChars;
+				memcpy(end, s->chars, s->nChars);
+			} else {
+				pending.push(s->left);
+				pending.push(s->right);
+			}
+		}
+		assert(end == buf);
+		
+		pending.deinit();
+		
+		chars = buf;
+		left = nullptr;
+		right = nullptr;
+	}
+	
+	// Hash in the style of wyhash: reads 16 to 48 bytes per step and
+	// folds each pair of words through a 64x64->128 bit multiply
+	
+	static uint64_t hashMix(uint64_t a, uint64_t b) {
+		auto r = (unsigned __int128)a * b;
+		return uint64_t(r) ^ uint64_t(r >> 64);
+	}
+	
+	static uint64_t hashRead64(unsigned char const *p) {
+		uint64_t r;
+		memcpy(&r, p, 8);
+		return r;
+	}
+	
+	static uint64_t hashRead32(unsigned char const *p) {
+		uint32_t r;
+		memcpy(&r, p, 4);
+		return r;
+	}
+	
+	static uint64_t hashChars(size_t nChars, char const *chars) {
+		static constexpr uint64_t s0 = 0xa0761d6478bd642full;
+		static constexpr uint64_t s1 = 0xe7037ed1a0b428dbull;
+		static constexpr uint64_t s2 = 0x8ebc6af09c88c6e3ull;
+		static constexpr uint64_t s3 = 0x589965cc75374cc3ull;
+		
+		auto p = (unsigned char const*)chars;
+		auto seed = hashMix(s0, s1);
+		
+		uint64_t a, b;
+		if (nChars <= 16) {
+			if (nChars >= 4) {
+				// Two possibly overlapping reads from each end
+				auto mid = (nChars >> 3) << 2;
+				a = (hashRead32(p) << 32) | hashRead32(p + mid);
+				b = (hashRead32(p + nChars - 4) << 32) | hashRead32(p + nChars - 4 - mid);
+			} else if (nChars > 0) {
+				a = (uint64_t(p[0]) << 16) | (uint64_t(p[nChars >> 1]) << 8) | p[nChars - 1];
+				b = 0;
+			} else {
+				a = 0;
+				b = 0;
+			}
+		} else {
+			auto i = nChars;
+			if (i > 48) {
+				// Three independent lanes of 16 bytes each
+				auto seed1 = seed, seed2 = seed;
+				do {
+					seed = hashMix(hashRead64(p) ^ s1, hashRead64(p + 8) ^ seed);
+					seed1 = hashMix(hashRead64(p + 16) ^ s2, hashRead64(p + 24) ^ seed1);
+					seed2 = hashMix(hashRead64(p + 32) ^ s3, hashRead64(p + 40) ^ seed2);
+					p += 48;
+					i -= 48;
+				} while (i > 48);
+				seed ^= seed1 ^ seed2;
+			}
+			while (i > 16) {
+				seed = hashMix(hashRead64(p) ^ s1, hashRead64(p + 8) ^ seed);
+				p += 16;
+				i -= 16;
+			}
+			a = hashRead64(p + i - 16);
+			b = hashRead64(p + i - 8);
+		}
+		
+		auto r = (unsigned __int128)(a ^ s1) * (b ^ seed);
+		return hashMix(uint64_t(r) ^ s0 ^ nChars, uint64_t(r >> 64) ^ s1);
+	}
+	
+	void String::computeHash() {
+		auto h = hashChars(nChars, getChars());
+		
+		// 0 marks the hash as not yet computed
+		hashVal = uint32_t(h ^ (h >> 32));
+		if (hashVal == 0) {
+			hashVal = 1;
 		}
-		return r * 2654435769u;
 	}
 	
 	bool String::isEqual(String *other) {
@@ -40,23 +152,64 @@ namespace SL {
 			return false;
 		}
 		
-		return memcmp(chars, other->chars, nChars) == 0;
+		if (hashVal != 0 && other->hashVal != 0 && hashVal != other->hashVal) {
+			return false;
+		}
+		
+		return memcmp(getChars(), other->getChars(), nChars) == 0;
 	}
 	
 	String *String::create(Heap *heap, size_t nChars) {
 		auto r = (String*)heap->createObject(
-			sizeof(String) + nChars,
+			sizeof(String) + nChars + 1,
 			objectTypeString
 		);
+		r->hashVal = 0;
 		r->nChars = nChars;
+		r->chars = (char*)(r + 1);
 		r->chars[nChars] = 0;
+		r->left = nullptr;
+		r->right = nullptr;
 		
 		return r;
 	}
 	
 	String *String::create(Heap *heap, size_t nChars, char const *chars) {
 		auto r = create(heap, nChars);
-		memcpy(r->chars, chars, nChars);
+		if (nChars > 0) {
+			memcpy(r->chars, chars, nChars);
+		}
+		
+		return r;
+	}
+	
+	String *String::createConcat(Heap *heap, String *left, String *right) {
+		// Results shorter than this are copied straight away, as a
+		// concatenation node would be about as large as the characters
+		static constexpr size_t minConcatNChars = 32;
+		
+		if (left->nChars == 0) {
+			return right;
+		} else if (right->nChars == 0) {
+			return left;
+		}
+		
+		auto nChars = left->nChars + right->nChars;
+		
+		if (nChars < minConcatNChars) {
+			auto r = create(heap, nChars);
+			memcpy(r->chars, left->getChars(), left->nChars);
+			memcpy(r->chars + left->nChars, right->getChars(), right->nChars);
+			
+			return r;
+		}
+		
+		auto r = (String*)heap->createObject(sizeof(String), objectTypeString);
+		r->hashVal = 0;
+		r->nChars = nChars;
+		r->chars = nullptr;
+		r->left = left;
+		r->right = right;
 		
 		return r;
 	}
@@ -67,8 +220,9 @@ namespace SL {
 		if (val.isNil()) {
 			return create(heap, 3, "nil");
 		} else if (val.isNumber()) {
-			auto len = snprintf(buf, sizeof(buf), "%.14g", val.numberVal);
-			return create(heap, (len >= 0)? len : 0, buf);
+			static_assert(sizeof(buf) >= maxNumberNChars);
+			auto len = formatNumber(val.numberVal, buf);
+			return create(heap, len, buf);
 		} else if (val.isString()) {
 			return val.stringVal;
 		} else if (val.isArray()) {
@@ -83,6 +237,9 @@ namespace SL {
 		} else if (val.isThread()) {
 			auto len = snprintf(buf, sizeof(buf), "thread@%p", val.threadVal);
 			return create(heap, (len >= 0)? len : 0, buf);
+		} else if (val.isChannel()) {
+			auto len = snprintf(buf, sizeof(buf), "channel@%p", val.channelVal);
+			return create(heap, (len >= 0)? len : 0, buf);
 		}
 		
 		assert(!"unreachable");
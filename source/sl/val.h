@@ -15,6 +15,7 @@ namespace SL {
 		typeStruct,
 		typeFunc,
 		typeThread,
+		typeChannel,
 	};
 	
 	struct String;
@@ -22,6 +23,7 @@ namespace SL {
 	struct Struct;
 	struct Func;
 	struct Thread;
+	struct Channel;
 	
 	struct Val {
 		Type type;
@@ -33,6 +35,7 @@ namespace SL {
 			Struct *structVal;
 			Func *funcVal;
 			Thread *threadVal;
+			Channel *channelVal;
 		};
 		
 		bool isNil() const {
@@ -63,6 +66,10 @@ namespace SL {
 			return type == typeThread;
 		}
 		
+		bool isChannel() const {
+			return type == typeChannel;
+		}
+		
 		bool equals(Val other) const;
 		
 		bool asBool() const {
@@ -103,22 +110,58 @@ namespace SL {
 			return Val{.type = typeThread, .threadVal = val};
 		}
 		
+		static Val newChannel(Channel *val) {
+			return Val{.type = typeChannel, .channelVal = val};
+		}
+		
 		static Val fromBool(bool val) {
 			return Val::newNumber(val? 1.0 : 0.0);
 		}
 	};
 	
 	struct String : public Object {
+		// Cached result of hash(), 0 if not yet computed
+		uint32_t hashVal;
+		
 		size_t nChars;
-		char chars[1];
 		
-		uint32_t hash();
+		// Null-terminated characters, stored inline after the header
+		// for strings created flat. Null if the string is a concatenation
+		// of left and right that has not yet been flattened.
+		char *chars;
+		String *left, *right;
+		
+		bool isFlat() const {
+			return chars != nullptr;
+		}
+		
+		// Gather the characters of a concatenation into one buffer
+		void flatten();
+		
+		char *getChars() {
+			if (!isFlat()) {
+				flatten();
+			}
+			return chars;
+		}
+		
+		uint32_t hash() {
+			if (hashVal == 0) {
+				computeHash();
+			}
+			return hashVal;
+		}
 		
 		bool isEqual(String *other);
 		
 		static String *create(Heap *heap, size_t nChars);
 		static String *create(Heap *heap, size_t nChars, char const *chars);
+		static String *createConcat(Heap *heap, String *left, String *right);
 		static String *createFromVal(Heap *heap, Val val);
+		
+	private:
+		void computeHash();
+		
 	};
 	
 	